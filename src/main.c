@@ -27,9 +27,12 @@ Memory map:
 EP0 Buf		00 - 3f
 EP4 Buf 	40 - 7f
 EP1 Buf		80 - bf
-RingBuf		100 - 1ff
+Trace		c0 - ff (TRACE)
+RingBuf		100 - 17f
+__xdata		180 - 2ff
 EP2 Buf		300 - 37f
 EP3 Buf 	380 - 3bf
+Capture		3c0 - 3ff (LOGIC_CAPTURE)
 */
 
 __xdata __at (0x0000) uint8_t  Ep0Buffer[DEFAULT_ENDP0_SIZE];	   //端点0 OUT&IN缓冲区，必须是偶地址
@@ -140,12 +143,139 @@ volatile __idata uint8_t UpPoint1_Ptr = 2;
 volatile __idata uint8_t UpPoint3_Busy = 0;   //上传端点是否忙标志
 volatile __idata uint8_t UpPoint3_Ptr = 2;
 
+/*
+ * MPSSE_CHAN_B: 接口B不做串口, 改成第二路软件移位的MPSSE JTAG(EP3/EP4)
+ * TCK P3.2(RTCK), TDI P3.1(TXD), TDO P3.0(RXD), TMS P3.5(RTS), GPIOL1和接口A共用P3.3(WAIT_IO), 此时接口A不能用自适应时钟
+ * 指令码由Mpsse_Opcode统一处理, 标准指令两个接口行为一样, 厂商指令(0xc0以上)只有接口A支持, 接口B回0xfa
+ */
+#define MPSSE_CHAN_B 0
+#if MPSSE_CHAN_B
+volatile __idata uint8_t B_Status = 0;
+volatile __idata uint8_t B_Instr = 0;
+volatile __idata uint8_t B_ShortLen = 0;
+volatile __idata uint16_t B_LongLen = 0;
+volatile __idata uint8_t B_Purge = 0;
+volatile __idata uint16_t B_Timeout = 0;
+#endif
+
 /* 杂项 */
 volatile __idata uint16_t SOF_Count = 0;
 volatile __idata uint8_t Latency_Timer = 4; //Latency Timer
 volatile __idata uint8_t Latency_Timer1 = 4;
 volatile __idata uint8_t Require_DFU = 0;
 
+/* 性能计数器, 厂商请求0xA0分段读出(小端, 依次为下面各项和Uart_Overrun, 共30字节), 0xA1清零 */
+#define PERF_COUNTERS 1
+
+#if PERF_COUNTERS
+typedef struct
+{
+	uint16_t Ep2_Packets;	//EP2收到的包
+	uint32_t Mpsse_Bytes;	//整字节移位
+	uint32_t Mpsse_Bits;	//按位移位
+	uint16_t Ep1_Busy;		//UpPoint1_Busy置位的时间, SOF_Count计
+	uint16_t Ep1_Full;		//EP1满64字节发送
+	uint16_t Ep1_Timeout;	//EP1 Latency Timer到期或0x87发送
+	uint16_t Ep3_Full;
+	uint16_t Ep3_Timeout;
+	uint16_t Ep4_Packets;	//EP4收到的包
+	uint16_t Bad_Opcode;	//不支持的MPSSE指令(回0xfa)
+	uint16_t Boot_Reset;	//打开上拉后第一次总线复位的时间, SOF_Count计
+	uint16_t Boot_Config;	//打开上拉后第一次SET_CONFIGURATION的时间
+} PERF_COUNTERS_T;
+
+__xdata PERF_COUNTERS_T Perf;
+#define PERF_ADD(field, n) Perf.field += (n)
+#else
+#define PERF_ADD(field, n)
+#endif
+
+/*
+ * 事件跟踪, 每条6字节: SOF_Count(小端), T0计数(小端, 0~999), 事件, 参数
+ * 时间 = SOF_Count * 1000 + T0计数, 以T0计数(Fsys/12, 16MHz时0.75us)为单位, 和SOF_Count一起约49秒回绕
+ * 放在EP1后面空着的XRAM, 满了覆盖最旧的, 用厂商请求0xA2取出, 每个EP0包一条
+ */
+#define TRACE 0
+
+#if PERF_COUNTERS || TRACE
+volatile __data uint16_t Uart_Overrun = 0; //RingBuf满丢掉的字节, 汇编里直接寻址
+#endif
+
+#if TRACE
+#define TRACE_EP2_OUT		1	//参数: 包长
+#define TRACE_CMD_START		2	//参数: 指令
+#define TRACE_CMD_END		3	//参数: 指令
+#define TRACE_FLUSH			4	//0x87, 参数: EP1里待发的字节数
+#define TRACE_EP1_IN		5	//参数: 包长
+#define TRACE_UART_OVERRUN	6	//参数: 累计丢弃数低8位, 主循环发现时才记录
+#define TRACE_SETUP			7	//参数: bRequest
+
+#define TRACE_REC	6
+#define TRACE_SIZE	(TRACE_REC * 10)
+__xdata __at (0x00c0) uint8_t Trace_Buf[TRACE_SIZE];
+volatile __idata uint8_t Trace_Head = 0;
+volatile __idata uint8_t Trace_Tail = 0;
+volatile __idata uint16_t Trace_Overrun = 0;
+
+/* 主循环和USB中断都会调用 */
+void Trace_Put(uint8_t id, uint8_t arg) __reentrant __critical
+{
+	uint8_t hi, lo;
+	uint16_t ms, t;
+
+	hi = TH0;
+	lo = TL0;
+	if(TH0 != hi)
+	{
+		hi = TH0;
+		lo = TL0;
+	}
+	t = (hi << 8) | lo;
+	ms = SOF_Count;
+	/* T0从65536 - 1000数到溢出, 中断里加SOF_Count; 关着中断时已经溢出的话计数从0重新开始 */
+	if(TF0 && t < 0x8000)
+		ms++;
+	else
+		t -= 65536 - 1000;
+
+	Trace_Buf[Trace_Head] = ms & 0xff;
+	Trace_Buf[Trace_Head + 1] = ms >> 8;
+	Trace_Buf[Trace_Head + 2] = t & 0xff;
+	Trace_Buf[Trace_Head + 3] = t >> 8;
+	Trace_Buf[Trace_Head + 4] = id;
+	Trace_Buf[Trace_Head + 5] = arg;
+	Trace_Head += TRACE_REC;
+	if(Trace_Head == TRACE_SIZE)
+		Trace_Head = 0;
+	if(Trace_Head == Trace_Tail)
+	{
+		Trace_Tail += TRACE_REC;
+		if(Trace_Tail == TRACE_SIZE)
+			Trace_Tail = 0;
+	}
+}
+#define TRACE_PUT(id, arg) Trace_Put(id, arg)
+#else
+#define TRACE_PUT(id, arg)
+#endif
+
+/*
+ * 逻辑采样, 厂商请求0xA3开始, 0xA4停止
+ * 0xA3: wValueL为T0重装周期(0为256), wValueH bit0: 1=Fsys/12计数, 否则Fsys
+ * 采样率 = 16MHz(或16MHz/12) / 周期, 每个采样一字节:
+ *   bit1 TMS, bit2 RXD, bit3 TXD, bit5 TDI, bit6 TDO, bit7 TCK
+ * 采样期间MPSSE和串口都暂停, 数据走EP1, 每包前面照常是2字节状态, 开始前先把EP1里没发完的MPSSE回传发掉
+ * 状态里的OE(0x02): EP1来不及发丢弃了一包, 或者周期太短一个采样没做完下一个已经到了(采样点不准)
+ */
+#define LOGIC_CAPTURE 1
+
+#if LOGIC_CAPTURE
+__xdata __at (0x03c0) uint8_t Capture_Buf[MAX_PACKET_SIZE]; //和Ep1Buffer轮流发送
+volatile __idata uint8_t Capture_Run = 0;
+volatile __idata uint8_t Capture_Period = 0;
+volatile __idata uint8_t Capture_Div12 = 0;
+#endif
+
 /* 流控 */
 volatile __idata uint8_t soft_dtr = 0;
 volatile __idata uint8_t soft_rts = 0;
@@ -155,6 +285,36 @@ volatile __idata uint8_t soft_rts = 0;
 volatile __idata uint8_t Mpsse_Status = 0;
 volatile __idata uint16_t Mpsse_LongLen = 0;
 volatile __idata uint8_t Mpsse_ShortLen = 0;
+volatile __idata uint8_t Mpsse_Flags = 0;
+volatile __idata uint16_t Rle_Count = 0;
+
+/* 厂商指令的回传队列, 由主循环逐字节搬到Ep1Buffer, 最长一个IN包(去掉2字节状态) */
+__xdata uint8_t Reply_Buf[62];
+volatile __idata uint8_t Reply_Len = 0;
+volatile __idata uint8_t Reply_Ptr = 0;
+
+/* 0x88/0x89/0x94/0x95 开始等待的时刻, 主机对该接口发SIO RESET(0x00)时置Wait_Abort放弃等待; 下标0接口A, 1接口B */
+volatile __idata uint16_t Wait_Start[1 + MPSSE_CHAN_B];
+volatile __idata uint8_t Wait_Abort[1 + MPSSE_CHAN_B];
+
+/* 自适应时钟, 由0x96/0x97开关 */
+volatile __idata uint8_t Rtck_Enable = 0;
+
+/* SET_BITMODE(0x0b), 控制请求里只记下来, 主循环在两条指令之间切换 */
+#define BITMODE_RESET	0x00
+#define BITMODE_BITBANG	0x01
+#define BITMODE_MPSSE	0x02
+#define BITMODE_SYNCBB	0x04
+
+volatile __idata uint8_t Bitbang_Mode = BITMODE_RESET;
+volatile __idata uint8_t Bitbang_Dir = 0;
+volatile __idata uint8_t Bitbang_Pending = 0;
+volatile __idata uint16_t Bitbang_Delay = 0; //每字节间隔, us
+
+uint8_t Bitbang_Read(void) __reentrant; //GET_BITMODE在中断里也要读
+
+/* JTAG TAP 状态跟踪 */
+volatile __idata uint8_t Tap_State = 0;
 
 #define HARD_ESP_CTRL 1
 
@@ -223,6 +383,8 @@ void USBDeviceIntCfg()
 	USB_INT_EN |= bUIE_DEV_SOF;													//打开SOF中断
 	USB_INT_FG |= 0x1F;													   //清中断标志
 	IE_USB = 1;															   //使能USB中断
+	IP_EX |= bIP_USB;														  //USB中断高优先级, 可以打断控制请求的处理
+	IE_UART1 = 1;															  //UART1没有用到, 软件置U1TI触发, 处理控制请求
 	EA = 1;																   //允许单片机中断
 }
 /*******************************************************************************
@@ -290,889 +452,2544 @@ void uuidcpy(__xdata uint8_t *dest, uint8_t index, uint8_t len) /* 使用UUID生
 #define INTF2_DTR	TIN3
 #define INTF2_RTS	TIN2
 
+/*
+ * 串口硬件流控, 主机用0x02(SetFlowCtrl)打开RTS/CTS, 均为低有效
+ * RTS: P3.5, 原来上电就拉低, 不开流控时保持低
+ * CTS: P3.2, 和接口A的RTCK是同一个脚(没有空闲的脚了), 两者互斥:
+ *   开着自适应时钟(0x96)时SetFlowCtrl(RTS_CTS)回STALL, 开着流控时0x96被忽略
+ * RingBuf到UART_RTS_HIGH时串口中断拉高RTS, 主循环搬到UART_RTS_LOW以下再放开
+ */
+#define UART_RTS	T1
+#define UART_CTS	INT0
+
+#ifndef UART_RTS_HIGH
+#define UART_RTS_HIGH	96
+#endif
+#ifndef UART_RTS_LOW
+#define UART_RTS_LOW	32
+#endif
+
+volatile __data uint8_t Uart_Flow = 0;		//汇编里直接寻址
+volatile __data uint8_t Uart_Tx_Paused = 0;	//CTS无效, EP4到串口暂停
+
+/* 0x06 SetEventChar: 收到该字符立刻发EP3; 0x07 SetErrorChar: 帧错误(停止位为0)的字节换成该字符 */
+volatile __data uint8_t Uart_Event_Char = 0;
+volatile __data uint8_t Uart_Event_En = 0;
+volatile __data uint8_t Uart_Event = 0;
+volatile __data uint8_t Uart_Error_Char = 0;
+volatile __data uint8_t Uart_Error_En = 0;
+
+/* FTDI线路状态里的错误位(OE 0x02, FE 0x08, BI 0x10), 串口中断置位, 发EP3包时读出清零 */
+volatile __data uint8_t Uart_Line_Err = 0;
+
+/* FTDI状态字节0: 低4位固定为1, bit4 CTS; DSR/RI/DCD板上没有引脚, 一直报0 */
+#define UART_MODEM_STATUS() (0x01 | (UART_CTS ? 0 : 0x10))
+/* 状态字节1, 只看不清错误位(GET_MODEM_STATUS用), EP3包头用Uart_Line_Status */
+#define UART_LINE_PEEK() (Uart_Line_Err | ((Serial_Done == 0 && USBReceived_1 == 0) ? 0x60 : 0))
+/* MPSSE接口没有串口也没有modem线, 状态字节1只报THRE/TEMT: OUT端点来的指令都处理完了 */
+#define MPSSE_LINE_STATUS(received) (((received) == 0) ? 0x60 : 0)
+
 volatile __idata uint8_t DTR_State = 0;
 volatile __idata uint8_t Modem_Count = 0;
 
-/*******************************************************************************
-* Function Name  : DeviceInterrupt()
-* Description	: CH559USB中断处理函数
-*******************************************************************************/
-void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB中断服务程序,使用寄存器组1
+/*
+ * 掉电保存的默认设置, 放在DataFlash(0xC000起, 只有偶地址有效), 上电时应用
+ * 厂商请求0xA5把当前的Latency Timer/串口波特率/SPI时钟存进去, 0xA6清除, 恢复编译时的默认值
+ * 0x91(FT_PROG写EEPROM)仍然是跳转BL, itdf_eeprom不变
+ */
+#define SETTINGS_MAGIC		0xa6
+#define SETTINGS_LATENCY	1
+#define SETTINGS_LATENCY1	2
+#define SETTINGS_UART_TH1	3
+#define SETTINGS_UART_CLK	4	//bit0: T2MOD的bT1_CLK
+#define SETTINGS_SPI_CK		5
+#define SETTINGS_SUM		6	//前面各字节的和取反
+#define SETTINGS_SIZE		7
+
+__xdata uint8_t Settings_Buf[SETTINGS_SIZE];
+
+/* 0xA5/0xA6只置标志, 写DataFlash放到主循环, 免得打断0xc6里正在进行的保存 */
+#define SETTINGS_REQ_SAVE	1
+#define SETTINGS_REQ_ERASE	2
+volatile __idata uint8_t Settings_Req = 0;
+
+/* 0x03 SetBaudRate也只记下divisor, 除法在主循环的Baud_Apply里做 */
+#define BAUD_REQ_INTF1	0x01
+#define BAUD_REQ_INTF2	0x02
+volatile __idata uint8_t Baud_Req = 0;
+__xdata uint16_t Baud_Div1;
+__xdata uint16_t Baud_Div2;
+
+uint8_t Settings_Sum(void)
 {
-	uint16_t len;
-	uint16_t divisor;
-	if ((USB_INT_ST & MASK_UIS_TOKEN) == UIS_TOKEN_SOF)
+	uint8_t i, sum = 0;
+
+	for(i = 0; i < SETTINGS_SUM; i++)
+		sum += Settings_Buf[i];
+	return ~sum;
+}
+
+void Settings_Write(void)
+{
+	uint8_t i;
+
+	SAFE_MOD = 0x55;
+	SAFE_MOD = 0xAA;
+	GLOBAL_CFG |= bDATA_WE;
+	SAFE_MOD = 0x00;
+	ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+	for(i = 0; i < SETTINGS_SIZE; i++)
 	{
-#ifdef SOF_NO_TIMER
-		SOF_Count ++;
-		if(Modem_Count)
-			Modem_Count --;
-        if(Modem_Count == 1)
-		{	
-			if(soft_dtr == 0 && soft_rts == 1)
+		ROM_ADDR_L = i << 1;
+		ROM_DATA_L = Settings_Buf[i];
+		if(ROM_STATUS & bROM_ADDR_OK)
+			ROM_CTRL = ROM_CMD_WRITE;
+	}
+	SAFE_MOD = 0x55;
+	SAFE_MOD = 0xAA;
+	GLOBAL_CFG &= ~bDATA_WE;
+	SAFE_MOD = 0x00;
+}
+
+void Settings_Save(void)
+{
+	Settings_Buf[0] = SETTINGS_MAGIC;
+	Settings_Buf[SETTINGS_LATENCY] = Latency_Timer;
+	Settings_Buf[SETTINGS_LATENCY1] = Latency_Timer1;
+	Settings_Buf[SETTINGS_UART_TH1] = TH1;
+	Settings_Buf[SETTINGS_UART_CLK] = (T2MOD & bT1_CLK) ? 0x01 : 0x00;
+	Settings_Buf[SETTINGS_SPI_CK] = SPI0_CK_SE;
+	Settings_Buf[SETTINGS_SUM] = Settings_Sum();
+	Settings_Write();
+}
+
+void Settings_Erase(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < SETTINGS_SIZE; i++)
+		Settings_Buf[i] = 0xff;
+	Settings_Write();
+}
+
+/* 校验不对(没存过或被清除)就保持编译时的默认值 */
+void Settings_Load(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < SETTINGS_SIZE; i++)
+		Settings_Buf[i] = *((__code uint8_t *) (DATA_FLASH_ADDR + (i << 1)));
+	if(Settings_Buf[0] != SETTINGS_MAGIC || Settings_Buf[SETTINGS_SUM] != Settings_Sum())
+		return;
+	Latency_Timer = Settings_Buf[SETTINGS_LATENCY];
+	Latency_Timer1 = Settings_Buf[SETTINGS_LATENCY1];
+	TH1 = Settings_Buf[SETTINGS_UART_TH1];
+	if(Settings_Buf[SETTINGS_UART_CLK] & 0x01)
+		T2MOD |= bT1_CLK;
+	else
+		T2MOD &= ~bT1_CLK;
+	if(Settings_Buf[SETTINGS_SPI_CK] != 0)
+		SPI0_CK_SE = Settings_Buf[SETTINGS_SPI_CK];
+}
+
+/* 主循环里执行SetBaudRate, 接口A只用来定Bit bang每字节的间隔(时钟是16倍波特率) */
+void Baud_Apply(void)
+{
+	uint8_t req;
+	uint16_t divisor, div1;
+
+	IE_UART1 = 0;
+	req = Baud_Req;
+	Baud_Req = 0;
+	div1 = Baud_Div1;
+	divisor = Baud_Div2;
+	IE_UART1 = 1;
+
+	if(req & BAUD_REQ_INTF1)
+		Bitbang_Delay = div1 / 48;
+	if((req & BAUD_REQ_INTF2) == 0)
+		return;
+
+	//U1SMOD = 1;
+	//PCON |= SMOD; //波特率加倍
+	//T2MOD |= bTMR_CLK; //最高计数时钟
+	PCON |= SMOD;
+	T2MOD |= bT1_CLK;
+	if(divisor == 0 || divisor == 1) //baudrate > 3M
+		TH1 = 0xff; //实在憋不出来1M
+	else
+	{
+		uint16_t div_tmp = 0;
+		div_tmp = 10 * divisor / 3; //16M CPU时钟
+		if (div_tmp % 10 >= 5) 	divisor = div_tmp / 10 + 1;
+		else 					divisor = div_tmp / 10;
+
+		if(divisor > 256)
+		{
+			//TH1 = 0 - SBAUD_TH; //统统使用预设波特率
+			divisor /= 12;
+			if(divisor > 256) //设置波特率小于488
 			{
-				INTF1_RTS = 1;
-				INTF1_DTR = 0;
+				TH1 = 0 - SBAUD_TH; //9600bps
 			}
-			if(soft_dtr == 1 && soft_rts == 0)
+			else
 			{
-				INTF1_RTS = 0;
-				INTF1_DTR = 1;
+				//PCON &= ~(SMOD);
+				T2MOD &= ~(bT1_CLK); //低波特率
+				TH1 = 0 - divisor;
 			}
-			if(soft_dtr == soft_rts)
-			{	
-				INTF1_DTR = 1;
-				INTF1_RTS = 0;
-				INTF1_RTS = 1;
-			}	
 		}
-		if(SOF_Count % 16 == 0)
-			PWM2 = 1;
-#endif
+		else
+			TH1 = 0 - divisor;
 	}
-	if(UIF_TRANSFER)															//USB传输完成标志
+}
+
+/*
+ * 控制传输放到低优先级的UART1中断里处理(USB中断置U1TI触发), USB中断只管数据端点, 保持很短
+ * 处理期间EP0回NAK, 主机会重试; USB中断是高优先级, 处理控制请求时EP1-EP4照常收发
+ * 不用INT0/INT1: 它们的脚P3.2/P3.3接着RTCK/CTS和WAIT_IO, 外部的边沿也会触发; UART1的脚P1.6/P1.7是SPI, 只借它的中断
+ * 这里面不能用_mulint/_divuint之类的库函数, 它们不可重入, 主循环也在用, 要算的放到主循环(Baud_Req, Settings_Req)
+ */
+volatile __idata uint8_t Ep0_Setup_Pending = 0;
+volatile __idata uint8_t Ep0_In_Pending = 0;
+volatile __idata uint8_t Ep0_Rx_Len = 0;
+
+void Ep0_Setup(void)
+{
+	uint16_t len;
+	uint16_t divisor;
+
+	len = Ep0_Rx_Len;
+	if(len == (sizeof(USB_SETUP_REQ)))
 	{
-		switch (USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP))
+		SetupLen = ((uint16_t)UsbSetupBuf->wLengthH << 8) | (UsbSetupBuf->wLengthL);
+		len = 0;													  // 默认为成功并且上传0长度
+		VendorControl = 0;
+		SetupReq = UsbSetupBuf->bRequest;
+		TRACE_PUT(TRACE_SETUP, SetupReq);
+		if ( ( UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK ) != USB_REQ_TYP_STANDARD )//非标准请求
 		{
-		case UIS_TOKEN_IN | 1:												  //endpoint 1# 端点批量上传
-			UEP1_T_LEN = 0;
-			UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_NAK;		   //默认应答NAK
-			UpPoint1_Busy = 0;												  //清除忙标志
-			break;
-		case UIS_TOKEN_OUT | 2:												 //endpoint 2# 端点批量下传
-			if ( U_TOG_OK )													 // 不同步的数据包将丢弃
-			{
-				UEP2_CTRL = UEP2_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_NAK;	   //收到一包数据就NAK，主函数处理完，由主函数修改响应方式
-				USBOutLength = USB_RX_LEN;
-				USBOutPtr = 0;
-				USBReceived = 1;
-			}
-			break;
-		case UIS_TOKEN_IN | 3:												  //endpoint 3# 端点批量上传
-			UEP3_T_LEN = 0;
-			UEP3_CTRL = UEP3_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_NAK;		   //默认应答NAK
-			UpPoint3_Busy = 0;												  //清除忙标志
-			break;
-		case UIS_TOKEN_OUT | 4:												 //endpoint 4# 端点批量下传
-			if ( U_TOG_OK )													 // 不同步的数据包将丢弃
+			//TODO: 重写
+			VendorControl = 1;
+			if(UsbSetupBuf->bRequestType & USB_REQ_TYP_READ)
 			{
-				UEP4_CTRL ^= bUEP_R_TOG;	//同步标志位翻转
-				UEP4_CTRL = UEP4_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_NAK;	   //收到一包数据就NAK，主函数处理完，由主函数修改响应方式
-				USBOutLength_1 = USB_RX_LEN + 64;
-				USBOutPtr_1 = 64;
-				USBReceived_1 = 1;
+				//读
+				switch( SetupReq )
+				{
+				case 0x90: //READ EEPROM
+					divisor = UsbSetupBuf->wIndexL & 0x3f;
+					Ep0Buffer[0] = itdf_eeprom[divisor] & 0xff;
+					Ep0Buffer[1] = itdf_eeprom[divisor] >> 8;
+					len = 2;
+					break;
+				case 0x0a:
+					if(UsbSetupBuf->wIndexL == 2)
+						Ep0Buffer[0] = Latency_Timer1;
+					else
+						Ep0Buffer[0] = Latency_Timer;
+					len = 1;
+					break;
+				case 0x0c: //GET BITMODE, 读引脚
+					Ep0Buffer[0] = Bitbang_Read();
+					len = 1;
+					break;
+				case 0x05: //GET MODEM STATUS, 和EP3包头一致
+					if(UsbSetupBuf->wIndexL == 2)
+					{
+				#if MPSSE_CHAN_B
+						Ep0Buffer[0] = 0x01;
+						Ep0Buffer[1] = MPSSE_LINE_STATUS(USBReceived_1);
+				#else
+						Ep0Buffer[0] = UART_MODEM_STATUS();
+						Ep0Buffer[1] = UART_LINE_PEEK();
+				#endif
+					}
+					else
+					{
+						Ep0Buffer[0] = 0x01;
+						Ep0Buffer[1] = MPSSE_LINE_STATUS(USBReceived);
+					}
+					len = 2;
+					break;
+#if TRACE
+				case 0xA2: //取出一条跟踪记录, 没有记录时返回0字节
+					len = 0;
+					if(SetupLen >= TRACE_REC && Trace_Tail != Trace_Head)
+					{
+						for(len = 0; len < TRACE_REC; len++)
+							Ep0Buffer[len] = Trace_Buf[Trace_Tail + len];
+						Trace_Tail += TRACE_REC;
+						if(Trace_Tail == TRACE_SIZE)
+							Trace_Tail = 0;
+					}
+					break;
+#endif
+#if PERF_COUNTERS
+				case 0xA0: //读性能计数器, wValueL为字节偏移, 每次最多一个EP0包
+					divisor = UsbSetupBuf->wValueL;
+					for(len = 0; len < DEFAULT_ENDP0_SIZE && len < SetupLen && divisor < sizeof(Perf) + 2; len++, divisor++)
+					{
+						if(divisor < sizeof(Perf))
+							Ep0Buffer[len] = ((__xdata uint8_t *) &Perf)[divisor];
+						else if(divisor == sizeof(Perf))
+							Ep0Buffer[len] = Uart_Overrun & 0xff;
+						else
+							Ep0Buffer[len] = Uart_Overrun >> 8;
+					}
+					break;
+#endif
+				default:
+					len = 0xFF;	 /*命令不支持*/
+					break;
+				}
 			}
-			break;
-		case UIS_TOKEN_SETUP | 0:												//SETUP事务
-			len = USB_RX_LEN;
-			if(len == (sizeof(USB_SETUP_REQ)))
+			else
 			{
-				SetupLen = ((uint16_t)UsbSetupBuf->wLengthH << 8) | (UsbSetupBuf->wLengthL);
-				len = 0;													  // 默认为成功并且上传0长度
-				VendorControl = 0;
-				SetupReq = UsbSetupBuf->bRequest;
-				if ( ( UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK ) != USB_REQ_TYP_STANDARD )//非标准请求
+				//写
+				switch( SetupReq )
 				{
-					//TODO: 重写
-					VendorControl = 1;
-					if(UsbSetupBuf->bRequestType & USB_REQ_TYP_READ)
+				case 0x02: //SET FLOW CONTROL
+					len = 0;
+					if(UsbSetupBuf->wIndexL == 2)
 					{
-						//读
-						switch( SetupReq )
+						/* CTS和RTCK共用P3.2, 接口A开着自适应时钟(0x96)时不能开RTS_CTS, STALL */
+						if((UsbSetupBuf->wIndexH & 0x01) && Rtck_Enable)
 						{
-						case 0x90: //READ EEPROM
-							divisor = UsbSetupBuf->wIndexL & 0x3f;
-							Ep0Buffer[0] = itdf_eeprom[divisor] & 0xff;
-							Ep0Buffer[1] = itdf_eeprom[divisor] >> 8;
-							len = 2;
-							break;
-						case 0x0a:
-							if(UsbSetupBuf->wIndexL == 2)
-								Ep0Buffer[0] = Latency_Timer1;
-							else
-								Ep0Buffer[0] = Latency_Timer;
-							len = 1;
-							break;
-						case 0x05:
-							Ep0Buffer[0] = 0x01;
-							Ep0Buffer[1] = 0x60;
-							len = 2;
-							break;
-						default:
-							len = 0xFF;	 /*命令不支持*/
+							len = 0xFF;
 							break;
 						}
+						Uart_Flow = UsbSetupBuf->wIndexH & 0x01; //RTS_CTS
+					#if !MPSSE_CHAN_B
+						if(Uart_Flow == 0)
+							UART_RTS = 0;
+					#endif
+					}
+					break;
+				case 0x06: //SET EVENT CHAR
+					if(UsbSetupBuf->wIndexL == 2)
+					{
+						Uart_Event_Char = UsbSetupBuf->wValueL;
+						Uart_Event_En = UsbSetupBuf->wValueH & 0x01;
+					}
+					len = 0;
+					break;
+				case 0x07: //SET ERROR CHAR
+					if(UsbSetupBuf->wIndexL == 2)
+					{
+						Uart_Error_Char = UsbSetupBuf->wValueL;
+						Uart_Error_En = UsbSetupBuf->wValueH & 0x01;
+					}
+					len = 0;
+					break;
+				case 0x0b: //SET BITMODE
+					if(UsbSetupBuf->wIndexL == 1)
+					{
+						Bitbang_Dir = UsbSetupBuf->wValueL;
+						Bitbang_Mode = UsbSetupBuf->wValueH;
+						Bitbang_Pending = 1;
+					}
+					len = 0;
+					break;
+				case 0x04:
+				case 0x92:
+					len = 0;
+					break;
+#if PERF_COUNTERS
+				case 0xA1: //清零性能计数器
+					memset(&Perf, 0, sizeof(Perf));
+					Uart_Overrun = 0;
+					len = 0;
+					break;
+#endif
+#if LOGIC_CAPTURE
+				case 0xA3: //开始逻辑采样
+					Capture_Period = UsbSetupBuf->wValueL;
+					Capture_Div12 = UsbSetupBuf->wValueH & 0x01;
+					Capture_Run = 1;
+					len = 0;
+					break;
+				case 0xA4: //停止逻辑采样
+					Capture_Run = 0;
+					len = 0;
+					break;
+#endif
+				case 0xA5: //当前设置存为上电默认值
+					Settings_Req = SETTINGS_REQ_SAVE;
+					len = 0;
+					break;
+				case 0xA6: //清除保存的设置
+					Settings_Req = SETTINGS_REQ_ERASE;
+					len = 0;
+					break;
+				case 0x91: //WRITE EEPROM, FT_PROG动作,直接跳转BL
+					Require_DFU = 1;
+					len = 0;
+					break;
+				case 0x00:
+					if(UsbSetupBuf->wIndexL == 1)
+					{
+						UpPoint1_Busy = 0;
+						Wait_Abort[0] = 1;
+					}
+					if(UsbSetupBuf->wIndexL == 2)
+					{
+					#if MPSSE_CHAN_B
+						Wait_Abort[1] = 1;
+					#endif
+						UpPoint3_Busy = 0;
+						UEP4_CTRL &= ~(bUEP_R_TOG);
 					}
+					len = 0;
+					break;
+				case 0x09: //SET LATENCY TIMER
+					if(UsbSetupBuf->wIndexL == 1)
+						Latency_Timer = UsbSetupBuf->wValueL;
 					else
+						Latency_Timer1 = UsbSetupBuf->wValueL;
+					len = 0;
+					break;
+				case 0x03: //SET BAUDRATE, 只记下divisor, 主循环里再算
+					divisor = UsbSetupBuf->wValueL |
+							  (UsbSetupBuf->wValueH << 8);
+					divisor &= 0x3fff; //没法发生小数取整数部分，baudrate = 48M/16/divisor
+					if(UsbSetupBuf->wIndexL == 1)
+					{
+						Baud_Div1 = divisor;
+						Baud_Req |= BAUD_REQ_INTF1;
+					}
+					else if(UsbSetupBuf->wIndexL == 2)
+					{
+						Baud_Div2 = divisor;
+						Baud_Req |= BAUD_REQ_INTF2;
+					}
+					len = 0;
+					break;
+				case 0x01: //MODEM Control
+#if HARD_ESP_CTRL
+					if(UsbSetupBuf->wIndexL == 2)
 					{
-						//写
-						switch( SetupReq )
+						if(UsbSetupBuf->wValueH & 0x01)
 						{
-						case 0x02:
-						case 0x04:
-						case 0x06:
-						case 0x07:
-						case 0x0b:
-						case 0x92:
-							len = 0;
-							break;
-						case 0x91: //WRITE EEPROM, FT_PROG动作,直接跳转BL
-							Require_DFU = 1;
-							len = 0;
-							break;
-						case 0x00:
-							if(UsbSetupBuf->wIndexL == 1)
-								UpPoint1_Busy = 0;
-							if(UsbSetupBuf->wIndexL == 2)
+							if(UsbSetupBuf->wValueL & 0x01) //DTR
 							{
-								UpPoint3_Busy = 0;
-								UEP4_CTRL &= ~(bUEP_R_TOG);
+								soft_dtr = 1;
+								//INTF1_DTR = 0;
 							}
-							len = 0;
-							break;
-						case 0x09: //SET LATENCY TIMER
-							if(UsbSetupBuf->wIndexL == 1)
-								Latency_Timer = UsbSetupBuf->wValueL;
 							else
-								Latency_Timer1 = UsbSetupBuf->wValueL;
-							len = 0;
-							break;
-						case 0x03:
-							//divisor = wValue
-							//U1SMOD = 1;
-							//PCON |= SMOD; //波特率加倍
-							//T2MOD |= bTMR_CLK; //最高计数时钟
-							PCON |= SMOD;
-							T2MOD |= bT1_CLK;
-
-							divisor = UsbSetupBuf->wValueL |
-									  (UsbSetupBuf->wValueH << 8);
-							divisor &= 0x3fff; //没法发生小数取整数部分，baudrate = 48M/16/divisor
-
-							if(divisor == 0 || divisor == 1) //baudrate > 3M
 							{
-								if(UsbSetupBuf->wIndexL == 2)
-									TH1 = 0xff; //实在憋不出来1M
+								soft_dtr = 0;
+								//INTF1_DTR = 1;
 							}
-							else
+						}
+						if(UsbSetupBuf->wValueH & 0x02)
+						{
+							if(UsbSetupBuf->wValueL & 0x02) //RTS
 							{
-								uint16_t div_tmp = 0;
-								div_tmp = 10 * divisor / 3; //16M CPU时钟
-								if (div_tmp % 10 >= 5) 	divisor = div_tmp / 10 + 1;
-								else 					divisor = div_tmp / 10;
-
-								if(divisor > 256)
-								{
-									//TH1 = 0 - SBAUD_TH; //统统使用预设波特率
-									if(UsbSetupBuf->wIndexL == 2)
-									{
-										divisor /= 12;
-										if(divisor > 256) //设置波特率小于488
-										{
-											TH1 = 0 - SBAUD_TH; //9600bps
-										}
-										else
-										{
-											//PCON &= ~(SMOD);
-											T2MOD &= ~(bT1_CLK); //低波特率
-											TH1 = 0 - divisor;
-										}
-									}
-								}
-								else
-								{
-									if(UsbSetupBuf->wIndexL == 2)
-										TH1 = 0 - divisor;
-								#if 0
-									else //intf2
-										SBAUD1 = 0 - divisor;
-								#endif
-								}
+								soft_rts = 1;
+								//INTF1_RTS = 0;
 							}
-							len = 0;
-							break;
-						case 0x01: //MODEM Control
-#if HARD_ESP_CTRL
-							if(UsbSetupBuf->wIndexL == 2)
+							else
 							{
-								if(UsbSetupBuf->wValueH & 0x01)
-								{
-									if(UsbSetupBuf->wValueL & 0x01) //DTR
-									{
-										soft_dtr = 1;
-										//INTF1_DTR = 0;
-									}
-									else
-									{
-										soft_dtr = 0;
-										//INTF1_DTR = 1;
-									}
-								}
-								if(UsbSetupBuf->wValueH & 0x02)
-								{
-									if(UsbSetupBuf->wValueL & 0x02) //RTS
-									{
-										soft_rts = 1;
-										//INTF1_RTS = 0;
-									}
-									else
-									{
-										soft_rts = 0;
-										//INTF1_RTS = 1;
-									}
-								}
-								Modem_Count = 20;
+								soft_rts = 0;
+								//INTF1_RTS = 1;
 							}
+						}
+						Modem_Count = 20;
+					}
 #else
-							if(Esp_Require_Reset == 3)
-							{
-								CAP1 = 0;
-								Esp_Require_Reset = 4;
-							}
+					if(Esp_Require_Reset == 3)
+					{
+						CAP1 = 0;
+						Esp_Require_Reset = 4;
+					}
 #endif
-							len = 0;
-							break;
-						default:
-							len = 0xFF;		 /*命令不支持*/
-							break;
-						}
+					len = 0;
+					break;
+				default:
+					len = 0xFF;		 /*命令不支持*/
+					break;
+				}
+			}
+
+		}
+		else															 //标准请求
+		{
+			switch(SetupReq)											 //请求码
+			{
+			case USB_GET_DESCRIPTOR:
+				switch(UsbSetupBuf->wValueH)
+				{
+				case USB_DESCR_TYP_DEVICE:													   //设备描述符
+					pDescr = DevDesc;										 //把设备描述符送到要发送的缓冲区
+					len = sizeof(DevDesc);
+					break;
+				case USB_DESCR_TYP_CONFIG:														//配置描述符
+					pDescr = CfgDesc;										  //把设备描述符送到要发送的缓冲区
+					len = sizeof(CfgDesc);
+					break;
+				case USB_DESCR_TYP_STRING:
+					if(UsbSetupBuf->wValueL == 0)
+					{
+						pDescr = LangDes;
+						len = sizeof(LangDes);
+					}
+					else if(UsbSetupBuf->wValueL == 1)
+					{
+						pDescr = Manuf_Des;
+						len = sizeof(Manuf_Des);
+					}
+					else if(UsbSetupBuf->wValueL == 2)
+					{
+						pDescr = Prod_Des;
+						len = sizeof(Prod_Des);
+					}
+					else if(UsbSetupBuf->wValueL == 4)
+					{
+						pDescr = Jtag_Des;
+						len = sizeof(Jtag_Des);
 					}
+					else
+					{
+						pDescr = (__code uint8_t *)0xffff;
+						len = 22; /* 10位ASCII序列号 */
+					}
+					break;
+				case USB_DESCR_TYP_QUALIF:
+					//pDescr = QualifierDesc;
+					//len = sizeof(QualifierDesc);
+					len = 0xff;
+					break;
+				default:
+					len = 0xff;												//不支持的命令或者出错
+					break;
+				}
 
+				if ( SetupLen > len )
+				{
+					SetupLen = len;	//限制总长度
 				}
-				else															 //标准请求
+				if (len != 0xff)
 				{
-					switch(SetupReq)											 //请求码
+					len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;							//本次传输长度
+			
+					if(pDescr == (__code uint8_t *) 0xffff) /* 取序列号的话 */
 					{
-					case USB_GET_DESCRIPTOR:
-						switch(UsbSetupBuf->wValueH)
-						{
-						case USB_DESCR_TYP_DEVICE:													   //设备描述符
-							pDescr = DevDesc;										 //把设备描述符送到要发送的缓冲区
-							len = sizeof(DevDesc);
-							break;
-						case USB_DESCR_TYP_CONFIG:														//配置描述符
-							pDescr = CfgDesc;										  //把设备描述符送到要发送的缓冲区
-							len = sizeof(CfgDesc);
-							break;
-						case USB_DESCR_TYP_STRING:
-							if(UsbSetupBuf->wValueL == 0)
-							{
-								pDescr = LangDes;
-								len = sizeof(LangDes);
-							}
-							else if(UsbSetupBuf->wValueL == 1)
-							{
-								pDescr = Manuf_Des;
-								len = sizeof(Manuf_Des);
-							}
-							else if(UsbSetupBuf->wValueL == 2)
-							{
-								pDescr = Prod_Des;
-								len = sizeof(Prod_Des);
-							}
-							else if(UsbSetupBuf->wValueL == 4)
-							{
-								pDescr = Jtag_Des;
-								len = sizeof(Jtag_Des);
-							}
-							else
-							{
-								pDescr = (__code uint8_t *)0xffff;
-								len = 22; /* 10位ASCII序列号 */
-							}
-							break;
-						case USB_DESCR_TYP_QUALIF:
-							//pDescr = QualifierDesc;
-							//len = sizeof(QualifierDesc);
-							len = 0xff;
-							break;
-						default:
-							len = 0xff;												//不支持的命令或者出错
-							break;
-						}
-
-						if ( SetupLen > len )
+						uuidcpy(Ep0Buffer, 0, len);
+					}
+					else
+					{
+					memcpy(Ep0Buffer, pDescr, len);								//加载上传数据
+					}
+					SetupLen -= len;
+					pDescr_Index = len;
+				}
+				break;
+			case USB_SET_ADDRESS:
+				SetupLen = UsbSetupBuf->wValueL;							  //暂存USB设备地址
+				break;
+			case USB_GET_CONFIGURATION:
+				Ep0Buffer[0] = UsbConfig;
+				if ( SetupLen >= 1 )
+				{
+					len = 1;
+				}
+				break;
+			case USB_SET_CONFIGURATION:
+				UsbConfig = UsbSetupBuf->wValueL;
+			#if PERF_COUNTERS
+				if(Perf.Boot_Config == 0)
+					Perf.Boot_Config = SOF_Count;
+			#endif
+				break;
+			case USB_GET_INTERFACE:
+				break;
+			case USB_CLEAR_FEATURE:											//Clear Feature
+				if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* 清除设备 */
+				{
+					if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
+					{
+						if( CfgDesc[ 7 ] & 0x20 )
 						{
-							SetupLen = len;	//限制总长度
+							/* 唤醒 */
 						}
-						if (len != 0xff)
+						else
 						{
-							len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;							//本次传输长度
-					
-							if(pDescr == (__code uint8_t *) 0xffff) /* 取序列号的话 */
-							{
-								uuidcpy(Ep0Buffer, 0, len);
-							}
-							else
-							{
-							memcpy(Ep0Buffer, pDescr, len);								//加载上传数据
-							}
-							SetupLen -= len;
-							pDescr_Index = len;
+							len = 0xFF;										/* 操作失败 */
 						}
+					}
+					else
+					{
+						len = 0xFF;											/* 操作失败 */
+					}
+				}
+				else if ( ( UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK ) == USB_REQ_RECIP_ENDP )// 端点
+				{
+					switch( UsbSetupBuf->wIndexL )
+					{
+					case 0x83:
+						UEP3_CTRL = UEP3_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
 						break;
-					case USB_SET_ADDRESS:
-						SetupLen = UsbSetupBuf->wValueL;							  //暂存USB设备地址
+					case 0x03:
+						UEP3_CTRL = UEP3_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
 						break;
-					case USB_GET_CONFIGURATION:
-						Ep0Buffer[0] = UsbConfig;
-						if ( SetupLen >= 1 )
-						{
-							len = 1;
-						}
+					case 0x82:
+						UEP2_CTRL = UEP2_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
 						break;
-					case USB_SET_CONFIGURATION:
-						UsbConfig = UsbSetupBuf->wValueL;
+					case 0x02:
+						UEP2_CTRL = UEP2_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
 						break;
-					case USB_GET_INTERFACE:
+					case 0x81:
+						UEP1_CTRL = UEP1_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
 						break;
-					case USB_CLEAR_FEATURE:											//Clear Feature
-						if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* 清除设备 */
-						{
-							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
-							{
-								if( CfgDesc[ 7 ] & 0x20 )
-								{
-									/* 唤醒 */
-								}
-								else
-								{
-									len = 0xFF;										/* 操作失败 */
-								}
-							}
-							else
-							{
-								len = 0xFF;											/* 操作失败 */
-							}
-						}
-						else if ( ( UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK ) == USB_REQ_RECIP_ENDP )// 端点
-						{
-							switch( UsbSetupBuf->wIndexL )
-							{
-							case 0x83:
-								UEP3_CTRL = UEP3_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
-								break;
-							case 0x03:
-								UEP3_CTRL = UEP3_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
-								break;
-							case 0x82:
-								UEP2_CTRL = UEP2_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
-								break;
-							case 0x02:
-								UEP2_CTRL = UEP2_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
-								break;
-							case 0x81:
-								UEP1_CTRL = UEP1_CTRL & ~ ( bUEP_T_TOG | MASK_UEP_T_RES ) | UEP_T_RES_NAK;
-								break;
-							case 0x01:
-								UEP1_CTRL = UEP1_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
-								break;
-							default:
-								len = 0xFF;										 // 不支持的端点
-								break;
-							}
-							UpPoint1_Busy = 0;
-							UpPoint3_Busy = 0;
-						}
-						else
-						{
-							len = 0xFF;												// 不是端点不支持
-						}
+					case 0x01:
+						UEP1_CTRL = UEP1_CTRL & ~ ( bUEP_R_TOG | MASK_UEP_R_RES ) | UEP_R_RES_ACK;
 						break;
-					case USB_SET_FEATURE:										  /* Set Feature */
-						if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* 设置设备 */
+					default:
+						len = 0xFF;										 // 不支持的端点
+						break;
+					}
+					UpPoint1_Busy = 0;
+					UpPoint3_Busy = 0;
+				}
+				else
+				{
+					len = 0xFF;												// 不是端点不支持
+				}
+				break;
+			case USB_SET_FEATURE:										  /* Set Feature */
+				if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* 设置设备 */
+				{
+					if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
+					{
+						if( CfgDesc[ 7 ] & 0x20 )
 						{
-							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
-							{
-								if( CfgDesc[ 7 ] & 0x20 )
-								{
-									/* 休眠 */
+							/* 休眠 */
 #ifdef DE_PRINTF
-									printf( "suspend\n" );															 //睡眠状态
+							printf( "suspend\n" );															 //睡眠状态
 
-									while ( XBUS_AUX & bUART0_TX )
-									{
-										;	//等待发送完成
-									}
+							while ( XBUS_AUX & bUART0_TX )
+							{
+								;	//等待发送完成
+							}
 #endif
 #if 0
-									SAFE_MOD = 0x55;
-									SAFE_MOD = 0xAA;
-									WAKE_CTRL = bWAK_BY_USB | bWAK_RXD0_LO | bWAK_RXD1_LO;					  //USB或者RXD0/1有信号时可被唤醒
-									PCON |= PD;																 //睡眠
-									SAFE_MOD = 0x55;
-									SAFE_MOD = 0xAA;
-									WAKE_CTRL = 0x00;
+							SAFE_MOD = 0x55;
+							SAFE_MOD = 0xAA;
+							WAKE_CTRL = bWAK_BY_USB | bWAK_RXD0_LO | bWAK_RXD1_LO;					  //USB或者RXD0/1有信号时可被唤醒
+							PCON |= PD;																 //睡眠
+							SAFE_MOD = 0x55;
+							SAFE_MOD = 0xAA;
+							WAKE_CTRL = 0x00;
 #endif
-								}
-								else
-								{
-									len = 0xFF;										/* 操作失败 */
-								}
-							}
-							else
-							{
-								len = 0xFF;											/* 操作失败 */
-							}
-						}
-						else if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_ENDP )			 /* 设置端点 */
-						{
-							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x00 )
-							{
-								switch( ( ( uint16_t )UsbSetupBuf->wIndexH << 8 ) | UsbSetupBuf->wIndexL )
-								{
-								case 0x83:
-									UEP3_CTRL = UEP3_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点3 IN STALL */
-									break;
-								case 0x03:
-									UEP3_CTRL = UEP3_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点3 OUT Stall */
-									break;
-								case 0x82:
-									UEP2_CTRL = UEP2_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点2 IN STALL */
-									break;
-								case 0x02:
-									UEP2_CTRL = UEP2_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点2 OUT Stall */
-									break;
-								case 0x81:
-									UEP1_CTRL = UEP1_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点1 IN STALL */
-									break;
-								case 0x01:
-									UEP1_CTRL = UEP1_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点1 OUT Stall */
-								default:
-									len = 0xFF;									/* 操作失败 */
-									break;
-								}
-							}
-							else
-							{
-								len = 0xFF;									  /* 操作失败 */
-							}
-						}
-						else
-						{
-							len = 0xFF;										  /* 操作失败 */
-						}
-						break;
-					case USB_GET_STATUS:
-						Ep0Buffer[0] = 0x00;
-						Ep0Buffer[1] = 0x00;
-						if ( SetupLen >= 2 )
-						{
-							len = 2;
 						}
 						else
 						{
-							len = SetupLen;
+							len = 0xFF;										/* 操作失败 */
 						}
-						break;
-					default:
-						len = 0xff;													//操作失败
-						break;
+					}
+					else
+					{
+						len = 0xFF;											/* 操作失败 */
 					}
 				}
-			}
-			else
-			{
-				len = 0xff;														 //包长度错误
-			}
-			if(len == 0xff)
-			{
-				SetupReq = 0xFF;
-				UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;//STALL
-			}
-			else if(len <= DEFAULT_ENDP0_SIZE)													   //上传数据或者状态阶段返回0长度包
-			{
-				UEP0_T_LEN = len;
-				UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;//默认数据包是DATA1，返回应答ACK
-			}
-			else
-			{
-				UEP0_T_LEN = 0;  //虽然尚未到状态阶段，但是提前预置上传0长度数据包以防主机提前进入状态阶段
-				UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;//默认数据包是DATA1,返回应答ACK
-			}
-			break;
-		case UIS_TOKEN_IN | 0:													  //endpoint0 IN
-			switch(SetupReq)
-			{
-			case USB_GET_DESCRIPTOR:
-				len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;			  //本次传输长度
-				if(pDescr == (__code uint8_t *)0xffff)
+				else if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_ENDP )			 /* 设置端点 */
 				{
-					uuidcpy(Ep0Buffer, pDescr_Index, len);
+					if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x00 )
+					{
+						switch( ( ( uint16_t )UsbSetupBuf->wIndexH << 8 ) | UsbSetupBuf->wIndexL )
+						{
+						case 0x83:
+							UEP3_CTRL = UEP3_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点3 IN STALL */
+							break;
+						case 0x03:
+							UEP3_CTRL = UEP3_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点3 OUT Stall */
+							break;
+						case 0x82:
+							UEP2_CTRL = UEP2_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点2 IN STALL */
+							break;
+						case 0x02:
+							UEP2_CTRL = UEP2_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点2 OUT Stall */
+							break;
+						case 0x81:
+							UEP1_CTRL = UEP1_CTRL & (~bUEP_T_TOG) | UEP_T_RES_STALL;/* 设置端点1 IN STALL */
+							break;
+						case 0x01:
+							UEP1_CTRL = UEP1_CTRL & (~bUEP_R_TOG) | UEP_R_RES_STALL;/* 设置端点1 OUT Stall */
+						default:
+							len = 0xFF;									/* 操作失败 */
+							break;
+						}
+					}
+					else
+					{
+						len = 0xFF;									  /* 操作失败 */
+					}
 				}
 				else
 				{
-					memcpy( Ep0Buffer, pDescr + pDescr_Index, len );								   //加载上传数据
+					len = 0xFF;										  /* 操作失败 */
 				}
-				SetupLen -= len;
-				pDescr_Index += len;
-				UEP0_T_LEN = len;
-				UEP0_CTRL ^= bUEP_T_TOG;											 //同步标志位翻转
 				break;
-			case USB_SET_ADDRESS:
-				if(VendorControl == 0)
+			case USB_GET_STATUS:
+				Ep0Buffer[0] = 0x00;
+				Ep0Buffer[1] = 0x00;
+				if ( SetupLen >= 2 )
+				{
+					len = 2;
+				}
+				else
 				{
-					USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | SetupLen;
-					UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+					len = SetupLen;
 				}
 				break;
 			default:
-				UEP0_T_LEN = 0;													  //状态阶段完成中断或者是强制上传0长度数据包结束控制传输
-				UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+				len = 0xff;													//操作失败
 				break;
 			}
-			break;
-		case UIS_TOKEN_OUT | 0:  // endpoint0 OUT
-			if(SetupReq == 0x22) //设置串口属性
-			{
-
-			}
-			else
-			{
-				UEP0_T_LEN = 0;
-				UEP0_CTRL |= UEP_R_RES_ACK | UEP_T_RES_NAK;  //状态阶段，对IN响应NAK
-			}
-			break;
-
-		default:
-			break;
 		}
-		UIF_TRANSFER = 0;														   //写0清空中断
 	}
-	if(UIF_BUS_RST)																 //设备模式USB总线复位中断
+	else
 	{
-#ifdef DE_PRINTF
-		printf( "reset\n" );															 //睡眠状态
-#endif
-		UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
-		UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
-		UEP2_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK | UEP_R_RES_ACK;
-		USB_DEV_AD = 0x00;
-		UIF_SUSPEND = 0;
-		UIF_TRANSFER = 0;
-		UIF_BUS_RST = 0;															 //清中断标志
-		UsbConfig = 0;		  //清除配置值
-		UpPoint1_Busy = 0;
-		UpPoint3_Busy = 0;
-
-		USBOutLength = 0;
-		USBOutPtr = 0;
-		USBReceived = 0;
-
-		USBOutLength_1 = 0;
-		USBOutPtr_1 = 0;
-		USBReceived_1 = 0;
-
-		Mpsse_ShortLen = 0;
-		Mpsse_LongLen = 0;
+		len = 0xff;														 //包长度错误
+	}
+	if(len == 0xff)
+	{
+		SetupReq = 0xFF;
+		UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;//STALL
+	}
+	else if(len <= DEFAULT_ENDP0_SIZE)													   //上传数据或者状态阶段返回0长度包
+	{
+		UEP0_T_LEN = len;
+		UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;//默认数据包是DATA1，返回应答ACK
+	}
+	else
+	{
+		UEP0_T_LEN = 0;  //虽然尚未到状态阶段，但是提前预置上传0长度数据包以防主机提前进入状态阶段
+		UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;//默认数据包是DATA1,返回应答ACK
+	}
+}
 
-		Mpsse_Status = 0;
-		UpPoint1_Ptr = 2;
-		UpPoint3_Ptr = 2;
+void Ep0_In(void)
+{
+	uint16_t len;
 
-		Serial_Done = 0;
-		USB_Require_Data = 0;
-	}
-	if (UIF_SUSPEND)																 //USB总线挂起/唤醒完成
+	switch(SetupReq)
 	{
-		UIF_SUSPEND = 0;
-		if ( USB_MIS_ST & bUMS_SUSPEND )											 //挂起
+	case USB_GET_DESCRIPTOR:
+		len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;			  //本次传输长度
+		if(pDescr == (__code uint8_t *)0xffff)
 		{
-#ifdef USB_SLEEP
-	#ifdef DE_PRINTF
-			printf( "suspend\n" );															 //睡眠状态
-	#endif
-			while ( XBUS_AUX & bUART0_TX )
-			{
-				;	//等待发送完成
-			}
-			SAFE_MOD = 0x55;
-			SAFE_MOD = 0xAA;
-			WAKE_CTRL = bWAK_BY_USB | bWAK_RXD0_LO | bWAK_RXD1_LO;					  //USB或者RXD0/1有信号时可被唤醒
-			PCON |= PD;																 //睡眠
-			SAFE_MOD = 0x55;
-			SAFE_MOD = 0xAA;
-			WAKE_CTRL = 0x00;
-#endif
+			uuidcpy(Ep0Buffer, pDescr_Index, len);
+		}
+		else
+		{
+			memcpy( Ep0Buffer, pDescr + pDescr_Index, len );								   //加载上传数据
 		}
+		SetupLen -= len;
+		pDescr_Index += len;
+		UEP0_T_LEN = len;
+		UEP0_CTRL = UEP0_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
+		UEP0_CTRL ^= bUEP_T_TOG;											 //同步标志位翻转
+		break;
+	case USB_SET_ADDRESS:
+		if(VendorControl == 0)
+		{
+			USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | SetupLen;
+			UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+		}
+		break;
+	default:
+		UEP0_T_LEN = 0;													  //状态阶段完成中断或者是强制上传0长度数据包结束控制传输
+		UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+		break;
 	}
-	else																			   //意外的中断,不可能发生的情况
+}
+
+void Ep0_Handler(void) __interrupt (INT_NO_UART1)
+{
+	U1TI = 0;
+	while(Ep0_Setup_Pending || Ep0_In_Pending)
 	{
-		USB_INT_FG = 0xFF;															 //清中断标志
+		if(Ep0_Setup_Pending)
+		{
+			Ep0_Setup_Pending = 0;
+			Ep0_In_Pending = 0;
+			Ep0_Setup();
+		}
+		else
+		{
+			Ep0_In_Pending = 0;
+			Ep0_In();
+		}
+	}
+}
+
+/*******************************************************************************
+* Function Name  : DeviceInterrupt()
+* Description	: CH559USB中断处理函数
+*******************************************************************************/
+void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB中断服务程序,使用寄存器组1
+{
+	if ((USB_INT_ST & MASK_UIS_TOKEN) == UIS_TOKEN_SOF)
+	{
+#ifdef SOF_NO_TIMER
+		SOF_Count ++;
+		if(UpPoint1_Busy)
+			PERF_ADD(Ep1_Busy, 1);
+		if(Modem_Count)
+			Modem_Count --;
+        if(Modem_Count == 1)
+		{	
+			if(soft_dtr == 0 && soft_rts == 1)
+			{
+				INTF1_RTS = 1;
+				INTF1_DTR = 0;
+			}
+			if(soft_dtr == 1 && soft_rts == 0)
+			{
+				INTF1_RTS = 0;
+				INTF1_DTR = 1;
+			}
+			if(soft_dtr == soft_rts)
+			{	
+				INTF1_DTR = 1;
+				INTF1_RTS = 0;
+				INTF1_RTS = 1;
+			}	
+		}
+		if(SOF_Count % 16 == 0)
+			PWM2 = 1;
+#endif
+	}
+	if(UIF_TRANSFER)															//USB传输完成标志
+	{
+		switch (USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP))
+		{
+		case UIS_TOKEN_IN | 1:												  //endpoint 1# 端点批量上传
+			TRACE_PUT(TRACE_EP1_IN, UEP1_T_LEN);
+			UEP1_T_LEN = 0;
+			UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_NAK;		   //默认应答NAK
+			UpPoint1_Busy = 0;												  //清除忙标志
+			break;
+		case UIS_TOKEN_OUT | 2:												 //endpoint 2# 端点批量下传
+			if ( U_TOG_OK )													 // 不同步的数据包将丢弃
+			{
+				UEP2_CTRL = UEP2_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_NAK;	   //收到一包数据就NAK，主函数处理完，由主函数修改响应方式
+				USBOutLength = USB_RX_LEN;
+				USBOutPtr = 0;
+				USBReceived = 1;
+				PERF_ADD(Ep2_Packets, 1);
+				TRACE_PUT(TRACE_EP2_OUT, USBOutLength);
+			}
+			break;
+		case UIS_TOKEN_IN | 3:												  //endpoint 3# 端点批量上传
+			UEP3_T_LEN = 0;
+			UEP3_CTRL = UEP3_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_NAK;		   //默认应答NAK
+			UpPoint3_Busy = 0;												  //清除忙标志
+			break;
+		case UIS_TOKEN_OUT | 4:												 //endpoint 4# 端点批量下传
+			if ( U_TOG_OK )													 // 不同步的数据包将丢弃
+			{
+				UEP4_CTRL ^= bUEP_R_TOG;	//同步标志位翻转
+				UEP4_CTRL = UEP4_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_NAK;	   //收到一包数据就NAK，主函数处理完，由主函数修改响应方式
+				USBOutLength_1 = USB_RX_LEN + 64;
+				USBOutPtr_1 = 64;
+				USBReceived_1 = 1;
+				PERF_ADD(Ep4_Packets, 1);
+			}
+			break;
+		case UIS_TOKEN_SETUP | 0:												//SETUP事务, 交给Ep0_Handler
+			Ep0_Rx_Len = USB_RX_LEN;
+			Ep0_In_Pending = 0;
+			Ep0_Setup_Pending = 1;
+			UEP0_CTRL = UEP0_CTRL & ~ (MASK_UEP_R_RES | MASK_UEP_T_RES) | UEP_R_RES_NAK | UEP_T_RES_NAK; //处理完之前NAK
+			U1TI = 1;
+			break;
+		case UIS_TOKEN_IN | 0:													  //endpoint0 IN, 交给Ep0_Handler
+			Ep0_In_Pending = 1;
+			UEP0_CTRL = UEP0_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_NAK;
+			U1TI = 1;
+			break;
+		case UIS_TOKEN_OUT | 0:  // endpoint0 OUT
+			if(SetupReq == 0x22) //设置串口属性
+			{
+
+			}
+			else
+			{
+				UEP0_T_LEN = 0;
+				UEP0_CTRL |= UEP_R_RES_ACK | UEP_T_RES_NAK;  //状态阶段，对IN响应NAK
+			}
+			break;
+
+		default:
+			break;
+		}
+		UIF_TRANSFER = 0;														   //写0清空中断
+	}
+	if(UIF_BUS_RST)																 //设备模式USB总线复位中断
+	{
+#ifdef DE_PRINTF
+		printf( "reset\n" );															 //睡眠状态
+#endif
+		UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+		UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
+		UEP2_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK | UEP_R_RES_ACK;
+		USB_DEV_AD = 0x00;
+		UIF_SUSPEND = 0;
+		UIF_TRANSFER = 0;
+		UIF_BUS_RST = 0;															 //清中断标志
+		UsbConfig = 0;		  //清除配置值
+	#if PERF_COUNTERS
+		if(Perf.Boot_Reset == 0)
+			Perf.Boot_Reset = SOF_Count;
+	#endif
+		UpPoint1_Busy = 0;
+		UpPoint3_Busy = 0;
+
+		USBOutLength = 0;
+		USBOutPtr = 0;
+		USBReceived = 0;
+
+		USBOutLength_1 = 0;
+		USBOutPtr_1 = 0;
+		USBReceived_1 = 0;
+
+		Mpsse_ShortLen = 0;
+		Mpsse_LongLen = 0;
+		Mpsse_Flags = 0;
+		Reply_Len = 0;
+		Reply_Ptr = 0;
+
+		Mpsse_Status = 0;
+		UpPoint1_Ptr = 2;
+		UpPoint3_Ptr = 2;
+	#if MPSSE_CHAN_B
+		B_Status = 0;
+		B_Purge = 0;
+	#endif
+
+		Serial_Done = 0;
+		USB_Require_Data = 0;
+
+		Ep0_Setup_Pending = 0;
+		Ep0_In_Pending = 0;
+	#if LOGIC_CAPTURE
+		Capture_Run = 0;
+	#endif
+
+		Bitbang_Mode = BITMODE_RESET;
+		Bitbang_Pending = 1;
+	}
+	if (UIF_SUSPEND)																 //USB总线挂起/唤醒完成
+	{
+		UIF_SUSPEND = 0;
+		if ( USB_MIS_ST & bUMS_SUSPEND )											 //挂起
+		{
+#ifdef USB_SLEEP
+	#ifdef DE_PRINTF
+			printf( "suspend\n" );															 //睡眠状态
+	#endif
+			while ( XBUS_AUX & bUART0_TX )
+			{
+				;	//等待发送完成
+			}
+			SAFE_MOD = 0x55;
+			SAFE_MOD = 0xAA;
+			WAKE_CTRL = bWAK_BY_USB | bWAK_RXD0_LO | bWAK_RXD1_LO;					  //USB或者RXD0/1有信号时可被唤醒
+			PCON |= PD;																 //睡眠
+			SAFE_MOD = 0x55;
+			SAFE_MOD = 0xAA;
+			WAKE_CTRL = 0x00;
+#endif
+		}
+	}
+	else																			   //意外的中断,不可能发生的情况
+	{
+		USB_INT_FG = 0xFF;															 //清中断标志
+
+	}
+}
+
+void SerialPort_Config()
+{
+	volatile uint32_t x;
+	volatile uint8_t x2;
+
+    /* P3.0 input */
+    P3_DIR_PU &= ~((1 << 0));
+	P3_MOD_OC &= ~((1 << 0));
+
+	/* P3.1 output, 只动自己的位, P3.2/P3.3的上拉在JTAG_IO_Config里已经设好 */
+	P3_MOD_OC &= ~((1 << 1));
+	P3_DIR_PU |= ((1 << 1));
+
+	/* P3.5 RTS 推挽输出 */
+	P3_MOD_OC &= ~((1 << 5));
+	P3_DIR_PU |= ((1 << 5));
+	UART_RTS = 0;
+
+	/* P3.2 CTS 上拉输入, 和RTCK共用, 不接时固定为无效(高), 和FTDI一样开流控就不发送, 不会悬空乱跳 */
+	P3_MOD_OC |= (1 << 2);
+	P3_DIR_PU |= (1 << 2);
+	UART_CTS = 1;
+
+	SM0 = 0;
+	SM1 = 1;
+	SM2 = 0;																   //串口0使用模式1
+	//使用Timer1作为波特率发生器
+	RCLK = 0;																  //UART0接收时钟
+	TCLK = 0;																  //UART0发送时钟
+	PCON |= SMOD;
+	x = 10 * FREQ_SYS / SBAUD_SET / 16;									   	//波特率的计算：16M/16/波特率
+																			//如果更改主频，注意x的值不要溢出
+	x2 = x % 10;
+	x /= 10;
+	if ( x2 >= 5 ) x ++;													   //四舍五入
+
+	TMOD = TMOD & ~ bT1_GATE & ~ bT1_CT & ~ MASK_T1_MOD | bT1_M1;			  //0X20，Timer1作为8位自动重载定时器
+	T2MOD = T2MOD | bTMR_CLK | bT1_CLK;										//Timer1时钟选择
+	TH1 = 0 - x;															   //12MHz晶振,buad/12为实际需设置波特率
+	TR1 = 1;																   //启动定时器1
+	TI = 0;
+	REN = 1;																   //串口0接收使能
+	ES = 1; //开串口中断
+	PS = 1; //中断优先级最高
+}
+
+/* FTDI状态字节1: 错误位读一次清一次, EP4来的数据都发完了才报THRE/TEMT */
+uint8_t Uart_Line_Status(void)
+{
+	uint8_t st;
+
+	ES = 0;
+	st = Uart_Line_Err;
+	Uart_Line_Err = 0;
+	ES = 1;
+	if(Serial_Done == 0 && USBReceived_1 == 0)
+		st |= 0x60;
+	return st;
+}
+
+/* 从bootloader跳回来时上拉断开的时间 */
+#ifndef BOOT_DETACH_MS
+#define BOOT_DETACH_MS	10
+#endif
+
+void Xtal_Enable(void) //使能外部时钟
+{
+	USB_INT_EN = 0;
+	USB_CTRL = 0x06;
+	
+	SAFE_MOD = 0x55;
+	SAFE_MOD = 0xAA;
+	CLOCK_CFG |= bOSC_EN_XT;                          //使能外部24M晶振
+	SAFE_MOD = 0x00;
+
+	/*
+	 * 系统时钟还是内部RC, 外部晶振只是打开, 所以不用等它起振
+	 * 要切到晶振的话, 关内部RC之前先等晶振稳定(几个ms)
+	 */
+//	SAFE_MOD = 0x55;
+//	SAFE_MOD = 0xAA;
+//	CLOCK_CFG &= ~bOSC_EN_INT;                        //关闭内部RC
+//	SAFE_MOD = 0x00;
+}
+
+/*******************************************************************************
+* Function Name  : Uart0_ISR()
+* Description	: 串口接收中断函数，实现循环缓冲接收
+*******************************************************************************/
+
+//Ring Buf
+
+volatile __idata uint8_t WritePtr = 0;
+volatile __idata uint8_t ReadPtr = 0;
+
+#ifndef HARD_ESP_CTRL
+__code uint8_t ESP_Boot_Sequence[] =
+{	
+	0x07, 0x07, 0x12, 0x20,
+	0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55
+};
+#endif
+
+#define FAST_RECEIVE
+
+#ifndef FAST_RECEIVE /* 年久失修的代码,不要维护了 */
+void Uart0_ISR(void) __interrupt (INT_NO_UART0) __using 1
+{	
+	if(RI)   //收到数据
+	{	
+		if((WritePtr + 1) % sizeof(RingBuf) != ReadPtr)
+		{
+			//环形缓冲写
+			RingBuf[WritePtr++] = SBUF;
+			WritePtr %= sizeof(RingBuf);
+		}
+		RI = 0;
+	}
+	if (TI)
+	{
+		if(USBOutPtr_1 >= USBOutLength_1)
+		{
+			UEP2_CTRL = UEP2_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_ACK;
+			TI = 0;
+		}
+		else
+		{
+			uint8_t ch = Ep2Buffer[USBOutPtr_1];
+			SBUF = ch;
+			TI = 0;
+#ifndef HARD_ESP_CTRL
+			if(ESP_Boot_Sequence[Esp_Boot_Chk] == ch)
+				Esp_Boot_Chk ++;
+			else
+				Esp_Boot_Chk = 0;
+
+			if(Esp_Boot_Chk >= (sizeof(ESP_Boot_Sequence) - 1))
+			{
+				if(Esp_Require_Reset == 0)
+					Esp_Require_Reset = 1;
+				Esp_Boot_Chk = 0;
+			}
+#endif
+			USBOutPtr_1++;
+		}
+	}
+
+}
+#else
+
+//汇编接收数据，选择寄存器组1，DPTR1 1.5M~150kHz~160 cycles
+void Uart0_ISR(void) __interrupt (INT_NO_UART0) __using 1 __naked
+{
+	__asm
+	push psw ;2
+	push a
+	push dph
+	push dpl
+
+ReadFromSerial:
+	jnb _RI, SendToSerial ;7
+
+	mov a, _WritePtr ;2
+	mov dpl, _ReadPtr
+
+	inc a ;1
+	anl dpl, #0x7f
+	anl a, #0x7f ;2
+
+	xrl a, dpl
+	jnz RingWrite
+
+	orl _Uart_Line_Err, #0x02 ;RingBuf满, 丢掉这个字节, 报OE
+#if PERF_COUNTERS || TRACE
+	inc _Uart_Overrun
+	mov a, _Uart_Overrun
+	jnz SendToSerial
+	inc (_Uart_Overrun + 1)
+#endif
+	sjmp SendToSerial
+
+RingWrite:
+	mov dph, #(_RingBuf >> 8) ;3
+	mov dpl, _WritePtr ;3
+	mov a, _SBUF ;2
+	jb _RB8, RxEventChk ;停止位为1, 没有帧错误
+	orl _Uart_Line_Err, #0x08 ;FE
+	jnz RxNotBreak
+	orl _Uart_Line_Err, #0x10 ;全0又没有停止位, 当作BREAK
+RxNotBreak:
+	mov a, _Uart_Error_En
+	jz RxNoError
+	mov a, _Uart_Error_Char
+	sjmp RxStore
+RxNoError:
+	mov a, _SBUF
+RxEventChk:
+	cjne a, _Uart_Event_Char, RxStore
+	mov _Uart_Event, _Uart_Event_En ;没开事件字符时为0
+RxStore:
+	movx @dptr, a ;1
+
+	inc _WritePtr ;1
+	anl _WritePtr, #0x7f ;2
+
+	mov a, _Uart_Flow
+	jz SendToSerial
+	mov a, _WritePtr
+	clr c
+	subb a, _ReadPtr
+	anl a, #0x7f
+	clr c
+	subb a, #UART_RTS_HIGH
+	jc SendToSerial
+	setb _T1 ;UART_RTS, 快满了
+
+SendToSerial:
+	clr _RI ;2
+
+	jnb _TI, ISR_End
+
+	clr c
+	mov a, _USBOutPtr_1
+	subb a, _USBOutLength_1
+	jc SerialTx
+
+UsbEpAck:
+	mov _Serial_Done, #1
+	sjmp Tx_End
+SerialTx:
+	mov a, _Uart_Flow
+	jz SerialTxGo
+	jnb _INT0, SerialTxGo ;UART_CTS
+	mov _Uart_Tx_Paused, #1 ;对方不收, 等主循环看到CTS有效再置TI
+	sjmp Tx_End
+SerialTxGo:
+	mov dph, #(_Ep4Buffer >> 8)
+	mov dpl, _USBOutPtr_1
+	movx a, @dptr
+	mov _SBUF, a
+	inc _USBOutPtr_1
+
+Tx_End:
+	clr _TI
+
+ISR_End:
+
+	pop dpl
+	pop dph
+	pop a
+	pop psw
+	reti
+	__endasm;
+}
+#endif
+
+//#define FAST_COPY_2
+//#define FAST_COPY_1
+
+void CLKO_Enable(void) //打开T2输出
+{
+	ET2 = 0;
+	T2CON = 0;
+	T2MOD = 0;
+	T2MOD |= bTMR_CLK | bT2_CLK | T2OE;
+	RCAP2H = 0xff;
+	RCAP2L = 0xfe;
+	TH2 = 0xff;
+	TL2 = 0xfe;
+	TR2 = 1;
+	P1_MOD_OC &= ~(0x01); //P1.0推挽输出
+	P1_DIR_PU |= 0x01;
+}
+
+#define TMS T2EX
+#define TDI MOSI
+#define TDO MISO
+#define TCK SCK
+#define TCK_CONT SCS
+
+/* 自适应时钟的RTCK输入, T2被CLKO和Run-Test占用, 只能轮询 */
+#define RTCK INT0
+#define RTCK_TIMEOUT 200
+
+/* 0x88/0x89/0x94/0x95 等待的GPIOL1, 接DONE/INIT_B/BUSY之类的就绪信号 */
+#define WAIT_IO INT1
+
+/* SWD模式: TMS(P1.1)做双向SWDIO, TCK做SWCLK */
+#define SWDIO TMS
+#define SWCLK TCK
+
+void JTAG_IO_Config(void)
+{
+	P1_DIR_PU |= ((1 << 1) | (1 << 5) | (1 << 7));
+	P1_DIR_PU &= ~((1 << 6) | (1 << 4));
+	P1_MOD_OC &= ~((1 << 1) | (1 << 5) | (1 << 7) | (1 << 6) | (1 << 4));
+	
+	TMS = 0;
+	TDI = 0;
+	TDO = 0;
+	TCK = 0;
+	TCK_CONT = 0;
+	/* P1.1 TMS, P1.5 TDI(MOSI), P1.7 TCK PP */
+	/* P1.6 TDO(MISO) INPUT */
+	/* P1.4 INPUT */
+
+#if !MPSSE_CHAN_B
+	/* P3.2 RTCK 上拉输入 */
+	P3_MOD_OC |= (1 << 2);
+	P3_DIR_PU |= (1 << 2);
+	RTCK = 1;
+#endif
+
+	/* P3.3 WAIT_IO 上拉输入 */
+	P3_MOD_OC |= (1 << 3);
+	P3_DIR_PU |= (1 << 3);
+	WAIT_IO = 1;
+}
+
+/* 等RTCK跟上TCK, 目标没接RTCK时超时放行 */
+void Rtck_Wait(uint8_t level)
+{
+	uint8_t t = RTCK_TIMEOUT;
+
+	if(level)
+		while(RTCK == 0 && --t);
+	else
+		while(RTCK && --t);
+}
+
+/* 自适应时钟的软件移位, LSB先出, TDO和MPSSE一样从高位移入; tms时数据送到TMS */
+uint8_t Rtck_Shift(uint8_t data, uint8_t count, uint8_t tms)
+{
+	uint8_t rcv = 0;
+
+	do
+	{
+		if(tms)
+			TMS = (data & 0x01);
+		else
+			TDI = (data & 0x01);
+		data >>= 1;
+		rcv >>= 1;
+		TCK = 1;
+		Rtck_Wait(1);
+		if(TDO)
+			rcv |= 0x80;
+		TCK = 0;
+		Rtck_Wait(0);
+	} while(--count);
+	return rcv;
+}
+
+/*
+ * Bit bang引脚和FT2232的ADBUS对应:
+ * bit0 TCK, bit1 TDI, bit2 TDO(只能输入), bit3 TMS, bit5 WAIT_IO(GPIOL1, 输入), bit7 RTCK(GPIOL3, 输入)
+ */
+uint8_t Bitbang_Read(void) __reentrant
+{
+	uint8_t v = 0;
+
+	if(TCK)
+		v |= 0x01;
+	if(TDI)
+		v |= 0x02;
+	if(TDO)
+		v |= 0x04;
+	if(TMS)
+		v |= 0x08;
+	if(WAIT_IO)
+		v |= 0x20;
+	if(RTCK)
+		v |= 0x80;
+	return v;
+}
+
+void Bitbang_Write(uint8_t v)
+{
+	if(Bitbang_Dir & 0x08)
+		TMS = (v & 0x08) ? 1 : 0;
+	if(Bitbang_Dir & 0x02)
+		TDI = (v & 0x02) ? 1 : 0;
+	if(Bitbang_Dir & 0x01)
+		TCK = (v & 0x01) ? 1 : 0;
+}
+
+/* 方向位为0的TCK/TDI/TMS改成高阻输入 */
+void Bitbang_Config(void)
+{
+	JTAG_IO_Config();
+	if((Bitbang_Dir & 0x01) == 0)
+		P1_DIR_PU &= ~(1 << 7);
+	if((Bitbang_Dir & 0x02) == 0)
+		P1_DIR_PU &= ~(1 << 5);
+	if((Bitbang_Dir & 0x08) == 0)
+		P1_DIR_PU &= ~(1 << 1);
+}
+
+uint8_t Bit_Reverse(uint8_t b)
+{
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+void Run_Test_Start()
+{
+	/* P1.7 INPUT, P1.4 PP */
+	PIN_FUNC |= bT2_PIN_X;
+	P1_DIR_PU &= ~((1 << 7));
+	P1_MOD_OC &= ~((1 << 7));
+	//TCK = 1;
+
+	RCAP2L = 0xfd;
+	
+	P1_DIR_PU |= ((1 << 4));
+	P1_MOD_OC &= ~((1 << 4));
+}
+
+void Run_Test_Stop()
+{
+	P1_DIR_PU &= ~((1 << 4));
+	P1_MOD_OC &= ~((1 << 4)); // P1.4 INPUT
+
+	RCAP2L = 0xfe;
+	PIN_FUNC &= ~bT2_PIN_X;
+
+	P1_DIR_PU |= ((1 << 7));
+	P1_MOD_OC &= ~((1 << 7)); // P1.7 OUTPUT
+}
+
+/* 0x4b/0x6b和Tap_Goto用汇编TMS移位, 0时用C循环 */
+#define MPSSE_ASM_TMS	1
+
+#if MPSSE_ASM_TMS
+/* Tms_Shift的参数, 汇编里直接访问 */
+volatile __data uint8_t Tms_Data = 0;
+volatile __data uint8_t Tms_Count = 0;
+
+/*
+ * 汇编TMS移位, Tms_Count(1~8)位, LSB先, 返回值从高位往下是TDO, 和MPSSE一样
+ * A同时当发送和接收移位寄存器: rrc把TMS位移出到C, 上一位采到的TDO从bit7移入
+ * 每位5条指令展开8份, 按位数跳到中间开始, 每个沿的周期数固定; Tms_Count超出1~8时按1或8处理
+ */
+uint8_t Tms_Shift(void) __naked
+{
+	__asm
+	mov a, _Tms_Count ;限制在1~8, 否则下面会跳到别的代码里
+	jnz TmsCntNz
+	inc a
+TmsCntNz:
+	cjne a, #9, TmsCntCmp
+TmsCntCmp:
+	jc TmsCntOk
+	mov a, #8
+TmsCntOk:
+	cpl a
+	add a, #9 ;8 - Tms_Count
+	mov b, #9 ;每份9字节
+	mul ab
+	add a, #<TmsBit8
+	push acc
+	clr a
+	addc a, #>TmsBit8
+	push acc
+	mov a, _Tms_Data
+	ret ;跳到第(8 - Tms_Count)份
+
+TmsBit8:
+	rrc a
+	mov _T2EX, c ;TMS
+	setb _SCK ;TCK
+	mov c, _MISO ;TDO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+	rrc a
+	mov _T2EX, c
+	setb _SCK
+	mov c, _MISO
+	clr _SCK
+
+	rrc a ;最后一位TDO
+	mov dpl, a
+	ret
+	__endasm;
+}
+#endif
+
+/* IEEE 1149.1 TAP状态, 编码与XSVF的XSTATE相同 */
+#define TAP_RESET		0x00
+#define TAP_IDLE		0x01
+#define TAP_DRSELECT	0x02
+#define TAP_DRCAPTURE	0x03
+#define TAP_DRSHIFT		0x04
+#define TAP_DREXIT1		0x05
+#define TAP_DRPAUSE		0x06
+#define TAP_DREXIT2		0x07
+#define TAP_DRUPDATE	0x08
+#define TAP_IRSELECT	0x09
+#define TAP_IRCAPTURE	0x0a
+#define TAP_IRSHIFT		0x0b
+#define TAP_IREXIT1		0x0c
+#define TAP_IRPAUSE		0x0d
+#define TAP_IREXIT2		0x0e
+#define TAP_IRUPDATE	0x0f
+
+/* 状态转移表, 低4位: TMS=0的下一状态, 高4位: TMS=1的下一状态 */
+__code uint8_t Tap_Trans[16] =
+{
+	0x01, 0x21, 0x93, 0x54, 0x54, 0x86, 0x76, 0x84,
+	0x21, 0x0a, 0xcb, 0xcb, 0xfd, 0xed, 0xfb, 0x21
+};
+
+/*
+ * 任意两状态间的最短TMS序列, 下标(from << 4) | to, LSB先
+ * Tap_Path_Len每字节两项, 低4位是to为偶数的长度, 高4位是奇数的, 最长8位
+ */
+__code uint8_t Tap_Path_Tms[256] =
+{
+	0x00, 0x00, 0x02, 0x02, 0x02, 0x0a, 0x0a, 0x2a, 0x1a, 0x06, 0x06, 0x06, 0x16, 0x16, 0x56, 0x36,
+	0x07, 0x00, 0x01, 0x01, 0x01, 0x05, 0x05, 0x15, 0x0d, 0x03, 0x03, 0x03, 0x0b, 0x0b, 0x2b, 0x1b,
+	0x03, 0x03, 0x00, 0x00, 0x00, 0x02, 0x02, 0x0a, 0x06, 0x01, 0x01, 0x01, 0x05, 0x05, 0x15, 0x0d,
+	0x1f, 0x03, 0x07, 0x00, 0x00, 0x01, 0x01, 0x05, 0x03, 0x0f, 0x0f, 0x0f, 0x2f, 0x2f, 0xaf, 0x6f,
+	0x1f, 0x03, 0x07, 0x07, 0x00, 0x01, 0x01, 0x05, 0x03, 0x0f, 0x0f, 0x0f, 0x2f, 0x2f, 0xaf, 0x6f,
+	0x0f, 0x01, 0x03, 0x03, 0x02, 0x00, 0x00, 0x02, 0x01, 0x07, 0x07, 0x07, 0x17, 0x17, 0x57, 0x37,
+	0x1f, 0x03, 0x07, 0x07, 0x01, 0x05, 0x00, 0x01, 0x03, 0x0f, 0x0f, 0x0f, 0x2f, 0x2f, 0xaf, 0x6f,
+	0x0f, 0x01, 0x03, 0x03, 0x00, 0x02, 0x02, 0x00, 0x01, 0x07, 0x07, 0x07, 0x17, 0x17, 0x57, 0x37,
+	0x07, 0x00, 0x01, 0x01, 0x01, 0x05, 0x05, 0x15, 0x00, 0x03, 0x03, 0x03, 0x0b, 0x0b, 0x2b, 0x1b,
+	0x01, 0x01, 0x05, 0x05, 0x05, 0x15, 0x15, 0x55, 0x35, 0x00, 0x00, 0x00, 0x02, 0x02, 0x0a, 0x06,
+	0x1f, 0x03, 0x07, 0x07, 0x07, 0x17, 0x17, 0x57, 0x37, 0x0f, 0x00, 0x00, 0x01, 0x01, 0x05, 0x03,
+	0x1f, 0x03, 0x07, 0x07, 0x07, 0x17, 0x17, 0x57, 0x37, 0x0f, 0x0f, 0x00, 0x01, 0x01, 0x05, 0x03,
+	0x0f, 0x01, 0x03, 0x03, 0x03, 0x0b, 0x0b, 0x2b, 0x1b, 0x07, 0x07, 0x02, 0x00, 0x00, 0x02, 0x01,
+	0x1f, 0x03, 0x07, 0x07, 0x07, 0x17, 0x17, 0x57, 0x37, 0x0f, 0x0f, 0x01, 0x05, 0x00, 0x01, 0x03,
+	0x0f, 0x01, 0x03, 0x03, 0x03, 0x0b, 0x0b, 0x2b, 0x1b, 0x07, 0x07, 0x00, 0x02, 0x02, 0x00, 0x01,
+	0x07, 0x00, 0x01, 0x01, 0x01, 0x05, 0x05, 0x15, 0x0d, 0x03, 0x03, 0x03, 0x0b, 0x0b, 0x2b, 0x00
+};
+
+__code uint8_t Tap_Path_Len[128] =
+{
+	0x10, 0x32, 0x44, 0x65, 0x35, 0x54, 0x65, 0x67,
+	0x03, 0x21, 0x33, 0x54, 0x24, 0x43, 0x54, 0x56,
+	0x32, 0x10, 0x22, 0x43, 0x13, 0x32, 0x43, 0x45,
+	0x35, 0x03, 0x11, 0x32, 0x42, 0x65, 0x76, 0x78,
+	0x35, 0x43, 0x10, 0x32, 0x42, 0x65, 0x76, 0x78,
+	0x24, 0x32, 0x03, 0x21, 0x31, 0x54, 0x65, 0x67,
+	0x35, 0x43, 0x32, 0x10, 0x42, 0x65, 0x76, 0x78,
+	0x24, 0x32, 0x21, 0x03, 0x31, 0x54, 0x65, 0x67,
+	0x13, 0x21, 0x33, 0x54, 0x20, 0x43, 0x54, 0x56,
+	0x21, 0x43, 0x55, 0x76, 0x06, 0x21, 0x32, 0x34,
+	0x35, 0x43, 0x55, 0x76, 0x46, 0x10, 0x21, 0x23,
+	0x35, 0x43, 0x55, 0x76, 0x46, 0x05, 0x21, 0x23,
+	0x24, 0x32, 0x44, 0x65, 0x35, 0x34, 0x10, 0x12,
+	0x35, 0x43, 0x55, 0x76, 0x46, 0x25, 0x03, 0x21,
+	0x24, 0x32, 0x44, 0x65, 0x35, 0x14, 0x32, 0x10,
+	0x13, 0x21, 0x33, 0x54, 0x24, 0x43, 0x54, 0x06
+};
+
+/* 按tms(LSB先)走count个TCK, 只更新状态, 不动IO */
+void Tap_Walk(uint8_t tms, uint8_t count)
+{
+	do
+	{
+		if(tms & 0x01)
+			Tap_State = Tap_Trans[Tap_State] >> 4;
+		else
+			Tap_State = Tap_Trans[Tap_State] & 0x0f;
+		tms >>= 1;
+	} while(--count);
+}
+
+void Jtag_Tms_Bit(uint8_t tms)
+{
+	TMS = tms;
+	TCK = 1;
+	Tap_Walk(tms, 1);
+	if(Rtck_Enable)
+		Rtck_Wait(1);
+	TCK = 0;
+	if(Rtck_Enable)
+		Rtck_Wait(0);
+}
+
+/* 用最短路径从当前状态走到target, 查表得到TMS序列, 调用前必须SPI_OFF */
+void Tap_Goto(uint8_t target)
+{
+	uint8_t i, tms, n;
+
+	i = (Tap_State << 4) | (target & 0x0f);
+	tms = Tap_Path_Tms[i];
+	n = Tap_Path_Len[i >> 1];
+	if(i & 0x01)
+		n >>= 4;
+	n &= 0x0f;
+	if(n == 0)
+		return;
+#if MPSSE_ASM_TMS
+	if(Rtck_Enable == 0)
+	{
+		Tms_Data = tms;
+		Tms_Count = n;
+		Tms_Shift();
+		Tap_State = target & 0x0f;
+		return;
+	}
+#endif
+	do
+	{
+		Jtag_Tms_Bit(tms & 0x01);
+		tms >>= 1;
+	} while(--n);
+}
+
+/* LSB先出count位TDI, tms_last时最后一位TMS=1, 返回右对齐的TDO */
+uint8_t Jtag_Shift_Bits(uint8_t data, uint8_t count, uint8_t tms_last)
+{
+	uint8_t rcv = 0;
+	uint8_t mask = 0x01;
+
+	TMS = 0;
+	do
+	{
+		TDI = (data & 0x01);
+		data >>= 1;
+		if(count == 1 && tms_last)
+			TMS = 1;
+		TCK = 1;
+		if(Rtck_Enable)
+			Rtck_Wait(1);
+		if(TDO)
+			rcv |= mask;
+		mask <<= 1;
+		TCK = 0;
+		if(Rtck_Enable)
+			Rtck_Wait(0);
+	} while(--count);
+	Tap_Walk(tms_last, 1);
+	return rcv;
+}
+
+#define MPSSE_IDLE			0
+#define MPSSE_RCV_LENGTH_L	1
+#define MPSSE_RCV_LENGTH_H	2
+#define MPSSE_TRANSMIT_BYTE 3
+#define MPSSE_RCV_LENGTH	4
+#define MPSSE_TRANSMIT_BIT	5
+#define MPSSE_ERROR			6
+#define MPSSE_TRANSMIT_BIT_MSB 7
+#define MPSSE_TMS_OUT		8
+#define MPSSE_NO_OP_1		9
+#define MPSSE_NO_OP_2		10
+#define MPSSE_TRANSMIT_BYTE_MSB	11
+#define MPSSE_RUN_TEST	12
+#define MPSSE_RCV_FLAGS		13
+#define MPSSE_SCAN_DATA		14
+#define MPSSE_XSVF_DATA		15
+#define MPSSE_RLE_DATA		16
+#define MPSSE_VERIFY_DATA	17
+#define MPSSE_SWD_COUNT		18
+#define MPSSE_SWD_REQ		19
+#define MPSSE_SWD_DATA		20
+#define MPSSE_WAIT_IO		21
+#define MPSSE_BITBANG		22
+/* 带回读的移位状态, 指令在收完长度时就选好, 内层不再判断指令码 */
+#define MPSSE_TRANSMIT_BYTE_RD		23
+#define MPSSE_TRANSMIT_BYTE_MSB_RD	24
+#define MPSSE_TRANSMIT_BIT_RD		25
+#define MPSSE_TRANSMIT_BIT_MSB_RD	26
+#define MPSSE_TMS_OUT_RD			27
+#define MPSSE_TUNE_FLAGS			28
+
+/*
+ * 厂商扩展指令, FTDI的MPSSE不使用0xc0以上的指令码
+ * MPSSE_VND_SCAN: 0xc0, flags, lenL, lenH, data...
+ *   走到Shift-IR/DR, 移出len+1位TDI(LSB先出, 最后一位TMS=1), 然后走到flags[7:4]指定的状态
+ *   flags bit0: 1=IR 0=DR, bit1: 回读TDO(每字节一个, 最后一字节右对齐)
+ */
+#define MPSSE_VND_SCAN		0xc0
+/*
+ * MPSSE_VND_XSVF: 0xc1, flags, lenL, lenH, data[len+1]
+ *   把len+1字节XSVF数据交给片上播放器, 一个文件可以分成任意多块发送
+ *   flags bit0: 新文件开始, 复位播放器
+ *   XCOMPLETE或出错时回传3字节: 状态码, 已执行的指令数(低, 高), 出错后剩余数据直接丢弃
+ */
+#define MPSSE_VND_XSVF		0xc1
+/*
+ * MPSSE_VND_RLE: 0xc2, lenL, lenH, stream[len+1]
+ *   和0x19一样LSB先出只写TDI, stream是RLE编码:
+ *   0x00-0x7f n: 后跟n+1个原样字节
+ *   0x80-0xff n, c, v: 字节v重复((n & 0x7f) << 8 | c) + 1次
+ */
+#define MPSSE_VND_RLE		0xc2
+/*
+ * MPSSE_VND_VERIFY: 0xc3, flags, lenL, lenH, record[len+1]
+ *   像0x39/0x31一样移位, 但TDO不回传, 而是和期望值比较并累计CRC32
+ *   record: [TDI] 期望TDO [mask], TDI/mask是否存在由flags决定
+ *   flags bit0: MSB先(0x31), 否则LSB先(0x39)
+ *   flags bit1: 记录带TDI字节, 否则TDI固定为bit2指定的值
+ *   flags bit2: 不带TDI字节时TDI为0xff, 否则为0x00
+ *   flags bit3: 记录带mask字节, 否则全部比较
+ *   flags bit4: 开始新的校验, 清零偏移/CRC/首个不符位置
+ *   flags bit5: 本指令结束后回传9字节: 是否不符, 首个不符的字节偏移(32位), CRC32(32位), 均为小端
+ */
+#define MPSSE_VND_VERIFY	0xc3
+/*
+ * MPSSE_VND_SWD: 0xc4, n, { req, [data0..3] } * (n+1)
+ *   连续执行n+1次SWD传输, req与CMSIS-DAP相同: bit0 APnDP, bit1 RnW, bit2-3 A[3:2]
+ *   写传输后跟4字节小端数据; 每次传输回传ACK(bit3: 读数据校验错), 读成功再跟4字节小端数据
+ *   线复位和JTAG-to-SWD切换序列直接用0x4b在TMS(SWDIO)上发送
+ */
+#define MPSSE_VND_SWD		0xc4
+/*
+ * MPSSE_VND_CHAIN: 0xc5
+ *   复位TAP, 从DR读出链上所有器件的IDCODE, 再量出IR总长度, 最后停在Run-Test/Idle
+ *   回传: 器件数(0xff: 超过CHAIN_MAX_DEVICES或链断开), IR总长度(0: 没测出), 每个器件4字节小端IDCODE(BYPASS器件为0)
+ */
+#define MPSSE_VND_CHAIN		0xc5
+/*
+ * MPSSE_VND_TUNE: 0xc6, flags
+ *   复位TAP后在Shift-DR里用硬件SPI移出固定图样, 先用TUNE_REF_DIV慢速读一遍作参考,
+ *   再从快到慢试SPI0_CK_SE, 每档连读TUNE_ROUNDS遍都和参考一致就选它, 最后停在Run-Test/Idle
+ *   flags bit0: 应用选出的分频, 否则恢复原来的; bit1: 同时存进DataFlash(同0xA5)
+ *   回传1字节: 选出的SPI0_CK_SE(TCK = Fsys / 它), 0表示TDO不动/没有可用的档位/开着自适应时钟
+ *   只调硬件SPI的整字节移位; 软件移位(按位/TMS指令, 自适应时钟, 不用硬件SPI的版本, 接口B)的TCK由KERNEL_BITS里的nop定死,
+ *   没有可调的档位, Bitbang_Delay是主机用SET_BAUDRATE定的bit bang输出间隔, 和TCK无关, 都不在这里调
+ */
+#define MPSSE_VND_TUNE		0xc6
+/*
+ * MPSSE_VND_GOTO: 0xd0-0xdf, 单字节
+ *   低4位是目标TAP状态(编码同TAP_*), 按Tap_Path_Tms查表走最短路径过去, TDI不变, 无回传
+ */
+#define MPSSE_VND_GOTO		0xd0
+
+#define SCAN_IR		0x01
+#define SCAN_READ	0x02
+
+#define XSVF_START	0x01
+
+#define TUNE_APPLY	0x01
+#define TUNE_SAVE	0x02
+
+#define VERIFY_MSB		0x01
+#define VERIFY_TDI		0x02
+#define VERIFY_TDI_ONES	0x04
+#define VERIFY_MASK		0x08
+#define VERIFY_START	0x10
+#define VERIFY_REPORT	0x20
+
+/* 2 + CHAIN_MAX_DEVICES * 4 不能超过Reply_Buf */
+#define CHAIN_MAX_DEVICES	15
+
+/* RLE解码状态, 放在Mpsse_Flags */
+#define RLE_CTL		0
+#define RLE_LITERAL	1
+#define RLE_COUNT	2
+#define RLE_REPEAT	3
+
+/* 展开重复字节时每步最多移出的字节数 */
+#ifndef RLE_CHUNK
+#define RLE_CHUNK	16
+#endif
+
+#define MPSSE_DEBUG	0
+#define MPSSE_HWSPI	1
+#define MPSSE_XSVF	1
+#define MPSSE_SWD	1
+
+#define GOWIN_INT_FLASH_QUIRK 1
+
+/*
+ * 主循环调度预算
+ * MPSSE_BUDGET: MPSSE引擎每轮最多连续处理的EP2字节数, 之后让出给串口
+ * UART_BUDGET: 串口每轮最多从RingBuf搬运到EP3的字节数
+ * UART_WATERMARK: RingBuf达到该水位才搬运, 否则等Latency_Timer1到期
+ */
+#ifndef MPSSE_BUDGET
+#define MPSSE_BUDGET	64
+#endif
+#ifndef UART_BUDGET
+#define UART_BUDGET		16
+#endif
+#ifndef UART_WATERMARK
+#define UART_WATERMARK	32
+#endif
+
+/*
+ * 0x88/0x89/0x94/0x95 的超时, SOF_Count计数, 0为一直等(和FTDI一样)
+ * 等待时EP2不会重新开放, 主机发不了新指令, 所以默认给个超时, 超时后看0x81的bit5
+ */
+#ifndef WAIT_IO_TIMEOUT
+#define WAIT_IO_TIMEOUT	1000
+#endif
 
+#if MPSSE_XSVF
+/* XSVF指令 */
+#define XCOMPLETE		0x00
+#define XTDOMASK		0x01
+#define XSIR			0x02
+#define XSDR			0x03
+#define XRUNTEST		0x04
+#define XREPEAT			0x07
+#define XSDRSIZE		0x08
+#define XSDRTDO			0x09
+#define XSDRB			0x0c
+#define XSDRC			0x0d
+#define XSDRE			0x0e
+#define XSDRTDOB		0x0f
+#define XSDRTDOC		0x10
+#define XSDRTDOE		0x11
+#define XSTATE			0x12
+#define XENDIR			0x13
+#define XENDDR			0x14
+#define XSIR2			0x15
+#define XCOMMENT		0x16
+#define XWAIT			0x17
+
+/* 状态码, 与Xilinx XAPP058的播放器相同 */
+#define XSVF_OK				0x00
+#define XSVF_TDOMISMATCH	0x02
+#define XSVF_ILLEGALCMD		0x04
+#define XSVF_ILLEGALSTATE	0x05
+#define XSVF_DATAOVERFLOW	0x06
+#define XSVF_RUNNING		0xff
+
+#define XSVF_PHASE_CMD		0
+#define XSVF_PHASE_ARGS		1
+#define XSVF_PHASE_COMMENT	2
+
+/* 单个向量最大字节数, XSDRSIZE超过XSVF_MAX_BYTES * 8位时报DATAOVERFLOW */
+#ifndef XSVF_MAX_BYTES
+#define XSVF_MAX_BYTES	64
+#endif
+
+/* Run-Test等待在主循环里分段进行, 每段最多这么多us, 段间照常服务EP1和串口 */
+#ifndef XSVF_WAIT_CHUNK
+#define XSVF_WAIT_CHUNK	500
+#endif
+
+/* 等完之后做什么: 没有, 重试XSDR, 其余为要去的TAP状态(XWAIT) */
+#define XSVF_THEN_NONE		0xff
+#define XSVF_THEN_SDR		0xfe
+
+/* Xsvf_Buf: [0, XSVF_MAX_BYTES) 参数/TDI, [XSVF_MAX_BYTES, 2 * XSVF_MAX_BYTES) 期望TDO */
+__xdata uint8_t Xsvf_Buf[XSVF_MAX_BYTES * 2];
+__xdata uint8_t Xsvf_Mask[XSVF_MAX_BYTES];
+__xdata uint8_t * __xdata Xsvf_Dst;
+__xdata uint16_t Xsvf_Pos;
+__xdata uint16_t Xsvf_Need;
+__xdata uint16_t Xsvf_Split;
+__xdata uint16_t Xsvf_Count;
+__xdata uint16_t Xsvf_SdrBits;
+__xdata uint32_t Xsvf_RunTest;
+__xdata uint8_t Xsvf_Cmd;
+__xdata uint8_t Xsvf_Phase;
+__xdata uint8_t Xsvf_Status = XSVF_OK;
+__xdata uint8_t Xsvf_Repeat;
+__xdata uint8_t Xsvf_EndIR;
+__xdata uint8_t Xsvf_EndDR;
+__xdata uint32_t Xsvf_Wait;		//还要等的us
+__xdata uint8_t Xsvf_Then = XSVF_THEN_NONE;
+__xdata uint32_t Xsvf_SdrWait;	//XSDR重试时的Run-Test时间, 每次加25%
+__xdata uint8_t Xsvf_Retry;
+
+/* 至少等待us微秒, 在Run-Test/Idle时每微秒送出一个TCK */
+void Jtag_Run_Test(uint32_t us)
+{
+	uint8_t clk = (Tap_State == TAP_IDLE);
+
+	TMS = 0;
+	while(us)
+	{
+		if(clk)
+		{
+			TCK = 1;
+			TCK = 0;
+		}
+		mDelayuS(1);
+		us--;
 	}
 }
 
-void SerialPort_Config()
+void Xsvf_Start(void)
 {
-	volatile uint32_t x;
-	volatile uint8_t x2;
-
-    /* P3.0 input */
-    P3_DIR_PU &= ~((1 << 0));
-	P3_MOD_OC &= ~((1 << 0));
+	uint8_t i;
 
-	/* P3.1 output */
-	P3_DIR_PU &= ((1 << 1));
-	P3_MOD_OC |= ~((1 << 1));
+	/* 主循环里不用memset/memcpy, 处理控制请求的中断里也在用, 它们不可重入 */
+	for(i = 0; i < XSVF_MAX_BYTES; i++)
+		Xsvf_Mask[i] = 0xff;
+	Xsvf_Phase = XSVF_PHASE_CMD;
+	Xsvf_Status = XSVF_RUNNING;
+	Xsvf_Count = 0;
+	Xsvf_SdrBits = 0;
+	Xsvf_RunTest = 0;
+	Xsvf_Repeat = 32;
+	Xsvf_EndIR = TAP_IDLE;
+	Xsvf_EndDR = TAP_IDLE;
+	Xsvf_Wait = 0;
+	Xsvf_Then = XSVF_THEN_NONE;
+}
 
-	SM0 = 0;
-	SM1 = 1;
-	SM2 = 0;																   //串口0使用模式1
-	//使用Timer1作为波特率发生器
-	RCLK = 0;																  //UART0接收时钟
-	TCLK = 0;																  //UART0发送时钟
-	PCON |= SMOD;
-	x = 10 * FREQ_SYS / SBAUD_SET / 16;									   	//波特率的计算：16M/16/波特率
-																			//如果更改主频，注意x的值不要溢出
-	x2 = x % 10;
-	x /= 10;
-	if ( x2 >= 5 ) x ++;													   //四舍五入
+void Xsvf_Finish(uint8_t status)
+{
+	Xsvf_Status = status;
+	Xsvf_Wait = 0;
+	Xsvf_Then = XSVF_THEN_NONE;
+	Reply_Buf[0] = status;
+	Reply_Buf[1] = Xsvf_Count & 0xff;
+	Reply_Buf[2] = Xsvf_Count >> 8;
+	Reply_Len = 3;
+}
 
-	TMOD = TMOD & ~ bT1_GATE & ~ bT1_CT & ~ MASK_T1_MOD | bT1_M1;			  //0X20，Timer1作为8位自动重载定时器
-	T2MOD = T2MOD | bTMR_CLK | bT1_CLK;										//Timer1时钟选择
-	TH1 = 0 - x;															   //12MHz晶振,buad/12为实际需设置波特率
-	TR1 = 1;																   //启动定时器1
-	TI = 0;
-	REN = 1;																   //串口0接收使能
-	ES = 1; //开串口中断
-	PS = 1; //中断优先级最高
+uint32_t Xsvf_Get32(uint8_t pos)
+{
+	return ((uint32_t)Xsvf_Buf[pos] << 24) | ((uint32_t)Xsvf_Buf[pos + 1] << 16) |
+		   ((uint16_t)Xsvf_Buf[pos + 2] << 8) | Xsvf_Buf[pos + 3];
 }
 
-void Xtal_Enable(void) //使能外部时钟
+/* XSVF向量为大端, 从最后一字节的bit0开始移; 返回非0表示TDO与期望不符 */
+uint8_t Xsvf_Shift(__xdata uint8_t *tdi, uint16_t bits, uint8_t last, uint8_t compare)
 {
-	USB_INT_EN = 0;
-	USB_CTRL = 0x06;
-	
-	SAFE_MOD = 0x55;
-	SAFE_MOD = 0xAA;
-	CLOCK_CFG |= bOSC_EN_XT;                          //使能外部24M晶振
-	SAFE_MOD = 0x00;
-	mDelaymS(50);
+	uint8_t i, n, tdo;
+	uint8_t fail = 0;
 
-//	SAFE_MOD = 0x55;
-//	SAFE_MOD = 0xAA;
-//	CLOCK_CFG &= ~bOSC_EN_INT;                        //关闭内部RC
-//	SAFE_MOD = 0x00;
-	mDelaymS(250);
+	i = (bits + 7) >> 3;
+	while(i--)
+	{
+		n = 8;
+		if(i == 0 && (bits & 0x07))
+			n = bits & 0x07;
+		tdo = Jtag_Shift_Bits(tdi[i], n, last && i == 0);
+		if(compare && ((tdo ^ Xsvf_Buf[XSVF_MAX_BYTES + i]) & Xsvf_Mask[i]))
+			fail = 1;
+	}
+	return fail;
 }
 
-/*******************************************************************************
-* Function Name  : Uart0_ISR()
-* Description	: 串口接收中断函数，实现循环缓冲接收
-*******************************************************************************/
-
-//Ring Buf
+/*
+ * XSDR/XSDRTDO, 不符时按XAPP058重试: Pause-DR, Exit2-DR, Shift-DR, Exit1-DR, Update-DR,
+ * 在Run-Test/Idle里打时钟等Xsvf_SdrWait, 再回Shift-DR重新移位, 每次Run-Test时间加25%
+ * 等待交给主循环分段做, 等完由Xsvf_Wait_Step回到这里
+ */
+void Xsvf_Sdr_Check(void)
+{
+	if(Xsvf_Shift(Xsvf_Buf, Xsvf_SdrBits, 1, 1) == 0)
+	{
+		Tap_Goto(Xsvf_EndDR);
+		Xsvf_Wait = Xsvf_SdrWait;
+		return;
+	}
+	if(Xsvf_SdrWait == 0 || Xsvf_Retry++ >= Xsvf_Repeat)
+	{
+		Xsvf_Finish(XSVF_TDOMISMATCH);
+		return;
+	}
+	Tap_Goto(TAP_DRPAUSE);
+	Tap_Goto(TAP_DRSHIFT);
+	Tap_Goto(TAP_IDLE);
+	Xsvf_Wait = Xsvf_SdrWait;
+	Xsvf_Then = XSVF_THEN_SDR;
+}
 
-volatile __idata uint8_t WritePtr = 0;
-volatile __idata uint8_t ReadPtr = 0;
+void Xsvf_Sdr(void)
+{
+	Xsvf_Retry = 0;
+	Xsvf_SdrWait = Xsvf_RunTest;
+	Tap_Goto(TAP_DRSHIFT);
+	Xsvf_Sdr_Check();
+}
 
-#ifndef HARD_ESP_CTRL
-__code uint8_t ESP_Boot_Sequence[] =
-{	
-	0x07, 0x07, 0x12, 0x20,
-	0x55, 0x55, 0x55, 0x55,
-	0x55, 0x55, 0x55, 0x55,
-	0x55, 0x55, 0x55, 0x55,
-	0x55, 0x55, 0x55, 0x55
-};
-#endif
+/* 主循环调用, 送出一段Run-Test, 全部等完后接着做Xsvf_Then */
+void Xsvf_Wait_Step(void)
+{
+	uint32_t us = Xsvf_Wait;
+	uint8_t then;
+
+	if(us > XSVF_WAIT_CHUNK)
+		us = XSVF_WAIT_CHUNK;
+	Jtag_Run_Test(us);
+	Xsvf_Wait -= us;
+	if(Xsvf_Wait != 0 || Xsvf_Then == XSVF_THEN_NONE)
+		return;
+	then = Xsvf_Then;
+	Xsvf_Then = XSVF_THEN_NONE;
+	if(then == XSVF_THEN_SDR)
+	{
+		Xsvf_SdrWait += Xsvf_SdrWait >> 2;
+		Tap_Goto(TAP_DRSHIFT);
+		Xsvf_Sdr_Check();
+	}
+	else
+		Tap_Goto(then);
+}
 
-#define FAST_RECEIVE
+/* 参数收齐后执行一条指令 */
+void Xsvf_Exec(void)
+{
+	uint8_t state, last;
+	uint16_t bits;
 
-#ifndef FAST_RECEIVE /* 年久失修的代码,不要维护了 */
-void Uart0_ISR(void) __interrupt (INT_NO_UART0) __using 1
-{	
-	if(RI)   //收到数据
-	{	
-		if((WritePtr + 1) % sizeof(RingBuf) != ReadPtr)
+	Xsvf_Count++;
+	switch(Xsvf_Cmd)
+	{
+	case XCOMPLETE:
+		Xsvf_Finish(XSVF_OK);
+		break;
+	case XTDOMASK: /* 已经直接收到Xsvf_Mask */
+		break;
+	case XSIR:
+	case XSIR2:
+		if(Xsvf_Cmd == XSIR)
+			bits = Xsvf_Buf[0];
+		else
+			bits = ((uint16_t)Xsvf_Buf[0] << 8) | Xsvf_Buf[1];
+		Tap_Goto(TAP_IRSHIFT);
+		Xsvf_Shift(Xsvf_Buf + (Xsvf_Cmd == XSIR ? 1 : 2), bits, 1, 0);
+		Tap_Goto(Xsvf_EndIR);
+		Xsvf_Wait = Xsvf_RunTest;
+		break;
+	case XSDR:
+	case XSDRTDO:
+		Xsvf_Sdr();
+		break;
+	case XSDRB:
+	case XSDRTDOB:
+		Tap_Goto(TAP_DRSHIFT);
+		/* fall through */
+	case XSDRC:
+	case XSDRTDOC:
+	case XSDRE:
+	case XSDRTDOE:
+		last = (Xsvf_Cmd == XSDRE || Xsvf_Cmd == XSDRTDOE);
+		if(Xsvf_Shift(Xsvf_Buf, Xsvf_SdrBits, last, Xsvf_Cmd >= XSDRTDOB))
 		{
-			//环形缓冲写
-			RingBuf[WritePtr++] = SBUF;
-			WritePtr %= sizeof(RingBuf);
+			Xsvf_Finish(XSVF_TDOMISMATCH);
+			break;
 		}
-		RI = 0;
+		if(last)
+		{
+			Tap_Goto(Xsvf_EndDR);
+			Xsvf_Wait = Xsvf_RunTest;
+		}
+		break;
+	case XRUNTEST:
+		Xsvf_RunTest = Xsvf_Get32(0);
+		break;
+	case XREPEAT:
+		Xsvf_Repeat = Xsvf_Buf[0];
+		break;
+	case XSDRSIZE:
+		if(Xsvf_Get32(0) > XSVF_MAX_BYTES * 8)
+			Xsvf_Finish(XSVF_DATAOVERFLOW);
+		else
+			Xsvf_SdrBits = Xsvf_Get32(0);
+		break;
+	case XSTATE:
+		state = Xsvf_Buf[0];
+		if(state > TAP_IRUPDATE)
+			Xsvf_Finish(XSVF_ILLEGALSTATE);
+		else if(state == TAP_RESET) /* 不管当前状态, 总是送5个TMS=1 */
+		{
+			for(state = 0; state < 5; state++)
+				Jtag_Tms_Bit(1);
+		}
+		else
+			Tap_Goto(state);
+		break;
+	case XENDIR:
+		Xsvf_EndIR = Xsvf_Buf[0] ? TAP_IRPAUSE : TAP_IDLE;
+		break;
+	case XENDDR:
+		Xsvf_EndDR = Xsvf_Buf[0] ? TAP_DRPAUSE : TAP_IDLE;
+		break;
+	case XWAIT:
+		if(Xsvf_Buf[0] > TAP_IRUPDATE || Xsvf_Buf[1] > TAP_IRUPDATE)
+		{
+			Xsvf_Finish(XSVF_ILLEGALSTATE);
+			break;
+		}
+		Tap_Goto(Xsvf_Buf[0]);
+		Xsvf_Wait = Xsvf_Get32(2);
+		if(Xsvf_Wait)
+			Xsvf_Then = Xsvf_Buf[1];
+		else
+			Tap_Goto(Xsvf_Buf[1]);
+		break;
+	default:
+		Xsvf_Finish(XSVF_ILLEGALCMD);
+		break;
 	}
-	if (TI)
+}
+
+/* 准备接收Xsvf_Cmd的参数, 返回参数字节数 */
+uint16_t Xsvf_ArgLen(void)
+{
+	uint8_t n = (Xsvf_SdrBits + 7) >> 3;
+
+	Xsvf_Dst = Xsvf_Buf;
+	Xsvf_Split = 0;
+	switch(Xsvf_Cmd)
 	{
-		if(USBOutPtr_1 >= USBOutLength_1)
+	case XTDOMASK:
+		Xsvf_Dst = Xsvf_Mask;
+		return n;
+	case XSDR:
+	case XSDRB:
+	case XSDRC:
+	case XSDRE:
+		return n;
+	case XSDRTDO:
+	case XSDRTDOB:
+	case XSDRTDOC:
+	case XSDRTDOE: /* 后一半是期望TDO */
+		Xsvf_Split = n;
+		return 2 * n;
+	case XRUNTEST:
+	case XSDRSIZE:
+		return 4;
+	case XREPEAT:
+	case XSTATE:
+	case XENDIR:
+	case XENDDR:
+	case XSIR: /* 先收长度 */
+		return 1;
+	case XSIR2:
+		return 2;
+	case XWAIT:
+		return 6;
+	default:
+		return 0;
+	}
+}
+
+/* 喂一字节XSVF数据 */
+void Xsvf_Feed(uint8_t ch)
+{
+	uint16_t bits;
+
+	if(Xsvf_Status != XSVF_RUNNING) /* 已结束或出错, 丢弃 */
+		return;
+
+	switch(Xsvf_Phase)
+	{
+	case XSVF_PHASE_CMD:
+		Xsvf_Cmd = ch;
+		Xsvf_Pos = 0;
+		if(ch == XCOMMENT)
 		{
-			UEP2_CTRL = UEP2_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_ACK;
-			TI = 0;
+			Xsvf_Phase = XSVF_PHASE_COMMENT;
+			break;
 		}
+		Xsvf_Need = Xsvf_ArgLen();
+		if(Xsvf_Need == 0)
+			Xsvf_Exec();
 		else
+			Xsvf_Phase = XSVF_PHASE_ARGS;
+		break;
+	case XSVF_PHASE_COMMENT:
+		if(ch == 0)
+			Xsvf_Phase = XSVF_PHASE_CMD;
+		break;
+	case XSVF_PHASE_ARGS:
+		*Xsvf_Dst++ = ch;
+		Xsvf_Pos++;
+		if(Xsvf_Pos == Xsvf_Split)
+			Xsvf_Dst = Xsvf_Buf + XSVF_MAX_BYTES;
+		if(Xsvf_Pos != Xsvf_Need)
+			break;
+		if((Xsvf_Cmd == XSIR && Xsvf_Pos == 1) || (Xsvf_Cmd == XSIR2 && Xsvf_Pos == 2))
 		{
-			uint8_t ch = Ep2Buffer[USBOutPtr_1];
-			SBUF = ch;
-			TI = 0;
-#ifndef HARD_ESP_CTRL
-			if(ESP_Boot_Sequence[Esp_Boot_Chk] == ch)
-				Esp_Boot_Chk ++;
+			/* 收到IR长度, 再收向量 */
+			if(Xsvf_Cmd == XSIR)
+				bits = Xsvf_Buf[0];
 			else
-				Esp_Boot_Chk = 0;
-
-			if(Esp_Boot_Chk >= (sizeof(ESP_Boot_Sequence) - 1))
+				bits = ((uint16_t)Xsvf_Buf[0] << 8) | Xsvf_Buf[1];
+			if(bits > (XSVF_MAX_BYTES - 2) * 8)
 			{
-				if(Esp_Require_Reset == 0)
-					Esp_Require_Reset = 1;
-				Esp_Boot_Chk = 0;
+				Xsvf_Finish(XSVF_DATAOVERFLOW);
+				break;
 			}
-#endif
-			USBOutPtr_1++;
+			Xsvf_Need += (bits + 7) >> 3;
+			if(bits != 0)
+				break;
 		}
+		Xsvf_Phase = XSVF_PHASE_CMD;
+		Xsvf_Exec();
+		break;
 	}
+}
+#endif
+
+/* 校验: 半字节查表的CRC32(多项式0xEDB88320), 只占64字节flash */
+__code uint32_t Crc32_Nibble[16] =
+{
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+#define VERIFY_PH_TDI	0
+#define VERIFY_PH_EXP	1
+#define VERIFY_PH_MASK	2
+
+__xdata uint32_t Verify_Crc;
+__xdata uint32_t Verify_Offset;
+__xdata uint32_t Verify_Mismatch;
+__xdata uint8_t Verify_Phase;
+__xdata uint8_t Verify_Tdi;
+__xdata uint8_t Verify_Exp;
+#if PERF_COUNTERS
+__xdata uint16_t Verify_Begin;	//本条指令开始时的Verify_Offset, 结束时一次记到Mpsse_Bytes
+#endif
 
+void Verify_Start(void)
+{
+	Verify_Crc = 0xffffffff;
+	Verify_Offset = 0;
+	Verify_Mismatch = 0xffffffff;
 }
-#else
 
-//汇编接收数据，选择寄存器组1，DPTR1 1.5M~150kHz~160 cycles
-void Uart0_ISR(void) __interrupt (INT_NO_UART0) __using 1 __naked
+/* 处理一个收到的TDO字节 */
+void Verify_Byte(uint8_t tdo, uint8_t mask)
 {
-	__asm
-	push psw ;2
-	push a
-	push dph
-	push dpl
+	Verify_Crc ^= tdo;
+	Verify_Crc = (Verify_Crc >> 4) ^ Crc32_Nibble[Verify_Crc & 0x0f];
+	Verify_Crc = (Verify_Crc >> 4) ^ Crc32_Nibble[Verify_Crc & 0x0f];
+	if(((tdo ^ Verify_Exp) & mask) && Verify_Mismatch == 0xffffffff)
+		Verify_Mismatch = Verify_Offset;
+	Verify_Offset++;
+}
 
-ReadFromSerial:
-	jnb _RI, SendToSerial ;7
+void Verify_Report(void)
+{
+	uint32_t crc = ~Verify_Crc;
+	uint8_t i;
 
-	mov a, _WritePtr ;2
-	mov dpl, _ReadPtr
+	Reply_Buf[0] = (Verify_Mismatch != 0xffffffff);
+	for(i = 0; i < 4; i++)
+	{
+		Reply_Buf[1 + i] = (Verify_Mismatch >> (i * 8)) & 0xff;
+		Reply_Buf[5 + i] = (crc >> (i * 8)) & 0xff;
+	}
+	Reply_Len = 9;
+}
 
-	inc a ;1
-	anl dpl, #0x7f
-	anl a, #0x7f ;2
+/* 0xc5, 调用前必须SPI_OFF */
+void Chain_Scan(void)
+{
+	uint8_t n, i, b;
+	uint32_t id;
 
-	xrl a, dpl
-	jz SendToSerial
+	for(i = 0; i < 5; i++)
+		Jtag_Tms_Bit(1);
 
-	mov dph, #(_RingBuf >> 8) ;3
-	mov dpl, _WritePtr ;3
-	mov a, _SBUF ;2
-	movx @dptr, a ;1
+	/* 复位后DR是IDCODE(32位, bit0为1)或BYPASS(1位0), TDI一直送1, 读到全1就是链尾 */
+	Tap_Goto(TAP_DRSHIFT);
+	n = 0;
+	while(1)
+	{
+		if(Jtag_Shift_Bits(0xff, 1, 0) == 0)
+			id = 0;
+		else
+		{
+			id = 1;
+			for(i = 1; i < 32; i += b)
+			{
+				b = (i == 25) ? 7 : 8;
+				id |= (uint32_t) Jtag_Shift_Bits(0xff, b, 0) << i;
+			}
+			if(id == 0xffffffff)
+				break;
+		}
+		if(n == CHAIN_MAX_DEVICES)
+		{
+			n = 0xff;
+			break;
+		}
+		for(i = 0; i < 4; i++)
+			Reply_Buf[2 + n * 4 + i] = (id >> (i * 8)) & 0xff;
+		n++;
+	}
 
-	inc _WritePtr ;1
-	anl _WritePtr, #0x7f ;2
+	/* IR先灌满1, 再送0, 数出来的1就是IR总长度 */
+	Tap_Goto(TAP_IRSHIFT);
+	for(i = 0; i < 32; i++)
+		Jtag_Shift_Bits(0xff, 8, 0);
+	b = 0;
+	for(i = 1; i != 0; i++)
+	{
+		if(Jtag_Shift_Bits(0x00, 1, 0) == 0)
+		{
+			b = i - 1;
+			break;
+		}
+	}
+	/* 离开Shift-IR一定经过Update-IR, 先重新灌满1(BYPASS), 免得全0的指令(多是EXTEST)生效 */
+	for(i = 0; i < 32; i++)
+		Jtag_Shift_Bits(0xff, 8, 0);
+	Tap_Goto(TAP_RESET);
+	Tap_Goto(TAP_IDLE);
+
+	Reply_Buf[0] = n;
+	Reply_Buf[1] = b;
+	Reply_Len = 2 + ((n == 0xff) ? CHAIN_MAX_DEVICES : n) * 4;
+}
 
-SendToSerial:
-	clr _RI ;2
+#if MPSSE_HWSPI
+#ifndef TUNE_ROUNDS
+#define TUNE_ROUNDS		4
+#endif
+#define TUNE_REF_DIV	(FREQ_SYS / 250000)	/* 参考读取用250kHz, 16MHz时为64 */
 
-	jnb _TI, ISR_End
+/* 快到慢 */
+__code uint8_t Tune_Div[] = {2, 3, 4, 6, 8, 12, 24, 48};
+__code uint8_t Tune_Pattern[] =
+{
+	0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc,
+	0x01, 0x80, 0xfe, 0x7f, 0x69, 0x96, 0x3c, 0xc3
+};
 
-	clr c
-	mov a, _USBOutPtr_1
-	subb a, _USBOutLength_1
-	jc SerialTx
+volatile __idata uint8_t Tune_Ones;
+volatile __idata uint8_t Tune_Zeros;
 
-UsbEpAck:
-	mov _Serial_Done, #1
-	sjmp Tx_End
-SerialTx:
-	mov dph, #(_Ep4Buffer >> 8)
-	mov dpl, _USBOutPtr_1
-	movx a, @dptr
-	mov _SBUF, a
-	inc _USBOutPtr_1
+/* 复位后在Shift-DR里按ck分频移出Tune_Pattern, 返回TDO的折叠校验 */
+uint16_t Tune_Pass(uint8_t ck)
+{
+	uint8_t i, tdo;
+	uint16_t sum = 0;
 
-Tx_End:
-	clr _TI
+	for(i = 0; i < 5; i++)
+		Jtag_Tms_Bit(1);
+	Tap_Goto(TAP_DRSHIFT);
+	TMS = 0;
+	SPI0_CK_SE = ck;
+	SPI0_SETUP |= bS0_BIT_ORDER;
+	SPI0_CTRL = bS0_MISO_OE | bS0_MOSI_OE | bS0_SCK_OE;
+	for(i = 0; i < sizeof(Tune_Pattern); i++)
+	{
+		SPI0_DATA = Tune_Pattern[i];
+		while(S0_FREE == 0);
+		tdo = SPI0_DATA;
+		Tune_Ones &= tdo;
+		Tune_Zeros |= tdo;
+		sum = ((sum << 1) | (sum >> 15)) ^ tdo;
+	}
+	SPI0_CTRL = 0;
+	return sum;
+}
 
-ISR_End:
+/* 0xc6, 调用前必须SPI_OFF */
+void Tck_Tune(uint8_t flags)
+{
+	uint8_t i, r, best = 0;
+	uint8_t old = SPI0_CK_SE;
+	uint16_t ref;
 
-	pop dpl
-	pop dph
-	pop a
-	pop psw
-	reti
-	__endasm;
+	if(Rtck_Enable == 0)
+	{
+		Tune_Ones = 0xff;
+		Tune_Zeros = 0x00;
+		ref = Tune_Pass(TUNE_REF_DIV);
+		if(Tune_Ones != 0xff && Tune_Zeros != 0x00) /* TDO卡死就不用试了 */
+		{
+			for(i = 0; i < sizeof(Tune_Div) && best == 0; i++)
+			{
+				for(r = 0; r < TUNE_ROUNDS; r++)
+				{
+					if(Tune_Pass(Tune_Div[i]) != ref)
+						break;
+				}
+				if(r == TUNE_ROUNDS)
+					best = Tune_Div[i];
+			}
+		}
+		Tap_Goto(TAP_RESET);
+		Tap_Goto(TAP_IDLE);
+	}
+
+	if(best != 0 && (flags & TUNE_APPLY))
+	{
+		SPI0_CK_SE = best;
+		if(flags & TUNE_SAVE)
+			Settings_Save();
+	}
+	else
+		SPI0_CK_SE = old;
+
+	Reply_Buf[0] = best;
+	Reply_Len = 1;
 }
 #endif
 
-//#define FAST_COPY_2
-//#define FAST_COPY_1
+#if MPSSE_SWD
+#define SWD_REQ_RNW		0x02
+
+#define SWD_ACK_OK		0x01
+#define SWD_ACK_WAIT	0x02
+#define SWD_ACK_FAULT	0x04
+#define SWD_PARITY_ERR	0x08
+
+#ifndef SWD_TURNAROUND
+#define SWD_TURNAROUND	1
+#endif
+#ifndef SWD_IDLE_CYCLES
+#define SWD_IDLE_CYCLES	2
+#endif
+#ifndef SWD_WAIT_RETRY
+#define SWD_WAIT_RETRY	100
+#endif
+
+__xdata uint8_t Swd_Buf[4];
+__xdata uint8_t Swd_Pos;
 
-void CLKO_Enable(void) //打开T2输出
+uint8_t Parity8(uint8_t b)
 {
-	ET2 = 0;
-	T2CON = 0;
-	T2MOD = 0;
-	T2MOD |= bTMR_CLK | bT2_CLK | T2OE;
-	RCAP2H = 0xff;
-	RCAP2L = 0xfe;
-	TH2 = 0xff;
-	TL2 = 0xfe;
-	TR2 = 1;
-	P1_MOD_OC &= ~(0x01); //P1.0推挽输出
-	P1_DIR_PU |= 0x01;
+	b ^= b >> 4;
+	b ^= b >> 2;
+	b ^= b >> 1;
+	return b & 0x01;
 }
 
-#define TMS T2EX
-#define TDI MOSI
-#define TDO MISO
-#define TCK SCK
-#define TCK_CONT SCS
-
-void JTAG_IO_Config(void)
+void Swdio_Output(void)
 {
-	P1_DIR_PU |= ((1 << 1) | (1 << 5) | (1 << 7));
-	P1_DIR_PU &= ~((1 << 6) | (1 << 4));
-	P1_MOD_OC &= ~((1 << 1) | (1 << 5) | (1 << 7) | (1 << 6) | (1 << 4));
-	
-	TMS = 0;
-	TDI = 0;
-	TDO = 0;
-	TCK = 0;
-	TCK_CONT = 0;
-	/* P1.1 TMS, P1.5 TDI(MOSI), P1.7 TCK PP */
-	/* P1.6 TDO(MISO) INPUT */
-	/* P1.4 INPUT */
+	P1_MOD_OC &= ~(1 << 1);
+	P1_DIR_PU |= (1 << 1);
 }
 
-void Run_Test_Start()
+void Swdio_Input(void)
 {
-	/* P1.7 INPUT, P1.4 PP */
-	PIN_FUNC |= bT2_PIN_X;
-	P1_DIR_PU &= ~((1 << 7));
-	P1_MOD_OC &= ~((1 << 7));
-	//TCK = 1;
+	P1_DIR_PU &= ~(1 << 1);
+	P1_MOD_OC &= ~(1 << 1); // P1.1 高阻输入
+}
 
-	RCAP2L = 0xfd;
-	
-	P1_DIR_PU |= ((1 << 4));
-	P1_MOD_OC &= ~((1 << 4));
+void Swd_Clock(uint8_t n)
+{
+	do
+	{
+		SWCLK = 1;
+		SWCLK = 0;
+	} while(--n);
 }
 
-void Run_Test_Stop()
+/* LSB先出, 目标在SWCLK上升沿采样 */
+void Swd_Write_Bits(uint8_t b, uint8_t n)
 {
-	P1_DIR_PU &= ~((1 << 4));
-	P1_MOD_OC &= ~((1 << 4)); // P1.4 INPUT
+	do
+	{
+		SWDIO = (b & 0x01);
+		b >>= 1;
+		SWCLK = 1;
+		SWCLK = 0;
+	} while(--n);
+}
 
-	RCAP2L = 0xfe;
-	PIN_FUNC &= ~bT2_PIN_X;
+/* 目标在上升沿后输出, 在下一个上升沿前采样, 返回右对齐 */
+uint8_t Swd_Read_Bits(uint8_t n)
+{
+	uint8_t b = 0;
+	uint8_t mask = 0x01;
 
-	P1_DIR_PU |= ((1 << 7));
-	P1_MOD_OC &= ~((1 << 7)); // P1.7 OUTPUT
+	do
+	{
+		if(SWDIO)
+			b |= mask;
+		mask <<= 1;
+		SWCLK = 1;
+		SWCLK = 0;
+	} while(--n);
+	return b;
 }
 
-#define MPSSE_IDLE			0
-#define MPSSE_RCV_LENGTH_L	1
-#define MPSSE_RCV_LENGTH_H	2
-#define MPSSE_TRANSMIT_BYTE 3
-#define MPSSE_RCV_LENGTH	4
-#define MPSSE_TRANSMIT_BIT	5
-#define MPSSE_ERROR			6
-#define MPSSE_TRANSMIT_BIT_MSB 7
-#define MPSSE_TMS_OUT		8
-#define MPSSE_NO_OP_1		9
-#define MPSSE_NO_OP_2		10
-#define MPSSE_TRANSMIT_BYTE_MSB	11
-#define MPSSE_RUN_TEST	12
+/* 执行一次SWD传输, 写数据/读结果都在Swd_Buf, 返回ACK */
+uint8_t Swd_Transfer(uint8_t req)
+{
+	uint8_t ack, i, parity;
+	uint8_t retry = SWD_WAIT_RETRY;
 
-#define MPSSE_DEBUG	0
-#define MPSSE_HWSPI	1
+	req &= 0x0f;
+	do
+	{
+		Swd_Write_Bits(0x81 | (req << 1) | (Parity8(req) << 5), 8);
+		Swdio_Input();
+		Swd_Clock(SWD_TURNAROUND);
+		ack = Swd_Read_Bits(3);
+		if(ack == SWD_ACK_OK)
+		{
+			parity = 0;
+			if(req & SWD_REQ_RNW)
+			{
+				for(i = 0; i < 4; i++)
+				{
+					Swd_Buf[i] = Swd_Read_Bits(8);
+					parity ^= Swd_Buf[i];
+				}
+				if(Parity8(parity) != Swd_Read_Bits(1))
+					ack |= SWD_PARITY_ERR;
+				Swd_Clock(SWD_TURNAROUND);
+				Swdio_Output();
+			}
+			else
+			{
+				Swd_Clock(SWD_TURNAROUND);
+				Swdio_Output();
+				for(i = 0; i < 4; i++)
+				{
+					Swd_Write_Bits(Swd_Buf[i], 8);
+					parity ^= Swd_Buf[i];
+				}
+				Swd_Write_Bits(Parity8(parity), 1);
+			}
+			SWDIO = 0;
+			Swd_Clock(SWD_IDLE_CYCLES);
+			SWDIO = 1;
+			return ack;
+		}
+		if(ack == SWD_ACK_WAIT || ack == SWD_ACK_FAULT)
+		{
+			Swd_Clock(SWD_TURNAROUND);
+			Swdio_Output();
+			SWDIO = 1;
+		}
+		else
+		{
+			/* 协议错误, 多给33个时钟等目标释放SWDIO */
+			Swd_Clock(SWD_TURNAROUND + 33);
+			Swdio_Output();
+			SWDIO = 1;
+			return ack;
+		}
+	} while(ack == SWD_ACK_WAIT && --retry);
+	return ack;
+}
 
-#define GOWIN_INT_FLASH_QUIRK 1
+/* 执行并把结果放进回传队列 */
+void Swd_Run(uint8_t req)
+{
+	uint8_t i;
+	uint8_t ack = Swd_Transfer(req);
+
+	Reply_Buf[0] = ack;
+	Reply_Len = 1;
+	if(ack == SWD_ACK_OK && (req & SWD_REQ_RNW))
+	{
+		for(i = 0; i < 4; i++)
+			Reply_Buf[1 + i] = Swd_Buf[i];
+		Reply_Len = 5;
+	}
+}
+#endif
 
 void SPI_Init()
 {
@@ -1371,6 +3188,8 @@ void mTimer0Interrupt(void) __interrupt (INT_NO_TMR0)                          /
 {
     mTimer_x_SetData(0,1000);                                                  //非自动重载方式需重新给TH0和TL0赋值,1MHz/1000=1000Hz, 1ms
     SOF_Count ++;
+	if(UpPoint1_Busy)
+		PERF_ADD(Ep1_Busy, 1);
 	if(Modem_Count)
 		Modem_Count --;
     if(Modem_Count == 1)
@@ -1380,74 +3199,641 @@ void mTimer0Interrupt(void) __interrupt (INT_NO_TMR0)                          /
 			INTF1_RTS = 1;
 			INTF1_DTR = 0;
 		}
-		if(soft_dtr == 1 && soft_rts == 0)
+		if(soft_dtr == 1 && soft_rts == 0)
+		{
+			INTF1_RTS = 0;
+			INTF1_DTR = 1;
+		}
+		if(soft_dtr == soft_rts)
+		{
+			INTF1_DTR = 1;
+			INTF1_RTS = 0;
+			INTF1_RTS = 1;
+		}
+	}
+	if(SOF_Count % 16 == 0)
+		PWM2 = 1;
+}
+
+void init_timer() {
+    mTimer0Clk12DivFsys();	                                                   //T0定时器时钟设置,12MHz/12=1MHz
+    mTimer_x_ModInit(0,1);                                                     //T0 定时器模式设置
+    mTimer_x_SetData(0,1000);	                                               //T0定时器赋值,1MHz/1000=1000Hz, 1ms
+    mTimer0RunCTL(1);                                                          //T0定时器启动	
+    ET0 = 1;                                                                   //T0定时器中断开启		
+    EA = 1;
+
+	SOF_Count = 0;
+}
+
+#if LOGIC_CAPTURE
+/*
+ * 0xA3之后在主循环里一直采样, 直到0xA4; T0改成8位自动重载, 查TF0定时, 不进中断
+ * 采样期间SOF_Count不走, 退出时按采样数补上, Latency Timer/WAIT_IO超时等不会跳变
+ */
+void Capture_Loop(void)
+{
+	__xdata uint8_t *fill;
+	uint8_t ptr;
+	uint16_t period;
+	uint32_t ticks = 0; /* T0计数, 每包加一次 */
+
+	/* 先把还没发的MPSSE回传发掉, 采样数据从新的一包开始 */
+	while(UpPoint1_Ptr > 2 || Reply_Len != 0)
+	{
+		while(UpPoint1_Busy);
+		while(Reply_Len != 0 && UpPoint1_Ptr < MAX_PACKET_SIZE)
+		{
+			Ep1Buffer[UpPoint1_Ptr++] = Reply_Buf[Reply_Ptr++];
+			if(Reply_Ptr == Reply_Len)
+			{
+				Reply_Len = 0;
+				Reply_Ptr = 0;
+			}
+		}
+		UpPoint1_Busy = 1;
+		UEP1_T_LEN = UpPoint1_Ptr;
+		UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
+		UpPoint1_Ptr = 2;
+	}
+	while(UpPoint1_Busy);
+
+	period = Capture_Period ? Capture_Period : 256;
+	ET0 = 0;
+	TR0 = 0;
+	if(Capture_Div12)
+		mTimer0Clk12DivFsys();
+	else
+		mTimer0ClkFsys();
+	mTimer_x_ModInit(0, 2);
+	TH0 = 0 - Capture_Period;
+	TL0 = TH0;
+	TF0 = 0;
+
+	Capture_Buf[0] = 0x01;
+	Capture_Buf[1] = 0x60;
+	Ep1Buffer[1] = 0x60;
+	fill = Ep1Buffer;
+	ptr = 2;
+	TR0 = 1;
+	while(Capture_Run)
+	{
+		if(TF0) /* 上一个采样没处理完这个采样时刻就过了 */
+			fill[1] |= 0x02;
+		while(TF0 == 0);
+		TF0 = 0;
+		fill[ptr++] = (P1 & 0xe2) | ((P3 & 0x03) << 2);
+		if(ptr == MAX_PACKET_SIZE)
+		{
+			ptr = 2;
+			ticks += (MAX_PACKET_SIZE - 2) * period;
+			if(UpPoint1_Busy) /* 上一包还没发走, 丢掉这一包 */
+			{
+				fill[1] |= 0x02;
+				continue;
+			}
+			UEP1_DMA = (uint16_t) fill;
+			UpPoint1_Busy = 1;
+			UEP1_T_LEN = MAX_PACKET_SIZE;
+			UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
+			fill = (fill == Ep1Buffer) ? Capture_Buf : Ep1Buffer;
+			fill[1] = 0x60;
+		}
+	}
+
+	/* 最后不满的一包也发出去 */
+	if(ptr > 2)
+	{
+		ticks += (ptr - 2) * period;
+		while(UpPoint1_Busy);
+		UEP1_DMA = (uint16_t) fill;
+		UpPoint1_Busy = 1;
+		UEP1_T_LEN = ptr;
+		UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
+	}
+
+	/* 恢复EP1和1ms定时 */
+	while(UpPoint1_Busy);
+	UEP1_DMA = (uint16_t) Ep1Buffer;
+	Ep1Buffer[1] = 0x60;
+	UpPoint1_Ptr = 2;
+	TR0 = 0;
+	mTimer0Clk12DivFsys();
+	mTimer_x_ModInit(0, 1);
+	mTimer_x_SetData(0, 1000);
+	TF0 = 0;
+	TR0 = 1;
+	SOF_Count += ticks / (Capture_Div12 ? 1000 : 12000);
+	ET0 = 1;
+}
+#endif
+
+#if MPSSE_HWSPI
+#define SPI_LSBFIRST() SPI0_SETUP |= bS0_BIT_ORDER
+#define SPI_MSBFIRST() SPI0_SETUP &= ~bS0_BIT_ORDER
+#define SPI_ON() { if(Rtck_Enable == 0) SPI0_CTRL = bS0_MISO_OE | bS0_MOSI_OE | bS0_SCK_OE; } /* 自适应时钟时只能软件移位 */
+#define SPI_OFF() SPI0_CTRL = 0;
+#else
+#define SPI_LSBFIRST()
+#define SPI_MSBFIRST()
+#define SPI_ON()
+#define SPI_OFF()
+#endif
+
+/*
+ * 移位内核模板, msb/rd用常数0/1展开时编译器会把不走的分支去掉
+ * KERNEL_BYTE: 整字节, 硬件SPI时位序在收长度时已经设好
+ * KERNEL_BITS: cnt+1位, clk/out/in是时钟/数据输出(TDI或TMS)/TDO引脚, 接口B换成自己的引脚,
+ *   TDO LSB先时从高位移入, MSB先时从低位移入; 用到外面的data和rcvdata
+ */
+#if MPSSE_HWSPI
+#define KERNEL_BYTE(msb, rd) \
+	{ \
+		SPI0_DATA = data; \
+		while(S0_FREE == 0); \
+		if(rd) rcvdata = SPI0_DATA; \
+	}
+#else
+#define KERNEL_BYTE(msb, rd) \
+	{ \
+		Mpsse_ShortLen = 7; \
+		KERNEL_BITS(TCK, MOSI, TDO, Mpsse_ShortLen, msb, rd); \
+	}
+#endif
+
+#define KERNEL_BITS(clk, out, in, cnt, msb, rd) \
+	{ \
+		rcvdata = 0; \
+		do \
+		{ \
+			clk = 0; \
+			out = msb ? (data & 0x80) : (data & 0x01); \
+			if(msb) data <<= 1; else data >>= 1; \
+			if(rd) { if(msb) rcvdata <<= 1; else rcvdata >>= 1; } \
+			__asm nop __endasm; \
+			__asm nop __endasm; \
+			clk = 1; \
+			if(rd && in) rcvdata |= msb ? 0x01 : 0x80; \
+			__asm nop __endasm; \
+			__asm nop __endasm; \
+		} while((cnt--) > 0); \
+		clk = 0; \
+	}
+
+/* 汇编版本的低位是移出剩下的数据, 要回读时清掉 */
+#if MPSSE_ASM_TMS
+#define KERNEL_TMS(rd) \
+	{ \
+		Tms_Data = data; \
+		Tms_Count = Mpsse_ShortLen + 1; \
+		rcvdata = Tms_Shift(); \
+		if(rd) rcvdata &= ~(0xff >> Tms_Count); \
+	}
+#else
+#define KERNEL_TMS(rd) KERNEL_BITS(TCK, TMS, TDO, Mpsse_ShortLen, 0, rd)
+#endif
+
+/* 标准MPSSE移位指令的译码, 接口A和B共用 */
+#define MPSSE_CMD_MSB(i)	(((i) & 0x08) == 0)	//bit3为0: MSB先
+#define MPSSE_CMD_RD(i)		((i) & 0x20)		//回读TDO
+#define MPSSE_CMD_TMS(i)	((i) & 0x40)		//数据送到TMS
+
+/* 指令码之后的状态, 不是下面这几类指令时返回MPSSE_IDLE, 由调用者自己处理 */
+uint8_t Mpsse_Cmd_State(uint8_t instr)
+{
+	switch(instr)
+	{
+		case 0x80:
+		case 0x82: /* 假Bit bang模式 */
+		case 0x86: /* 调速，暂时不支持 */
+			return MPSSE_NO_OP_1;
+		case 0x19:
+		case 0x39:
+		case 0x11:
+		case 0x31:
+			return MPSSE_RCV_LENGTH_L;
+		case 0x6b:
+		case 0x4b:
+		case 0x3b:
+		case 0x1b:
+		case 0x13:
+		case 0x33:
+			return MPSSE_RCV_LENGTH;
+	}
+	return MPSSE_IDLE;
+}
+
+/* 整字节指令收完长度后的移位状态 */
+uint8_t Mpsse_Byte_State(uint8_t instr)
+{
+	if(MPSSE_CMD_MSB(instr))
+		return MPSSE_CMD_RD(instr) ? MPSSE_TRANSMIT_BYTE_MSB_RD : MPSSE_TRANSMIT_BYTE_MSB;
+	return MPSSE_CMD_RD(instr) ? MPSSE_TRANSMIT_BYTE_RD : MPSSE_TRANSMIT_BYTE;
+}
+
+/* 按位/TMS指令收完长度后的移位状态 */
+uint8_t Mpsse_Bit_State(uint8_t instr)
+{
+	if(MPSSE_CMD_TMS(instr))
+		return MPSSE_CMD_RD(instr) ? MPSSE_TMS_OUT_RD : MPSSE_TMS_OUT;
+	if(MPSSE_CMD_MSB(instr))
+		return MPSSE_CMD_RD(instr) ? MPSSE_TRANSMIT_BIT_MSB_RD : MPSSE_TRANSMIT_BIT_MSB;
+	return MPSSE_CMD_RD(instr) ? MPSSE_TRANSMIT_BIT_RD : MPSSE_TRANSMIT_BIT;
+}
+
+#if MPSSE_CHAN_B
+#define B_TCK	INT0	/* P3.2 */
+#define B_TDI	TXD		/* P3.1 */
+#define B_TDO	RXD		/* P3.0 */
+#define B_TMS	T1		/* P3.5 */
+
+void Chan_B_IO_Config(void)
+{
+	/* P3.1 P3.2 P3.5 推挽输出, P3.0 输入 */
+	P3_MOD_OC &= ~((1 << 0) | (1 << 1) | (1 << 2) | (1 << 5));
+	P3_DIR_PU |= ((1 << 1) | (1 << 2) | (1 << 5));
+	P3_DIR_PU &= ~((1 << 0));
+	B_TCK = 0;
+	B_TDI = 0;
+	B_TMS = 0;
+}
+
+/* 接口B的低字节引脚, 位置和Bitbang_Read一样, GPIOL1和接口A共用WAIT_IO */
+uint8_t Chan_B_Read(void)
+{
+	uint8_t v = 0;
+
+	if(B_TCK)
+		v |= 0x01;
+	if(B_TDI)
+		v |= 0x02;
+	if(B_TDO)
+		v |= 0x04;
+	if(B_TMS)
+		v |= 0x08;
+	if(WAIT_IO)
+		v |= 0x20;
+	return v;
+}
+
+#define MPSSE_REPLY(chan, v) { if(chan) Ep3Buffer[UpPoint3_Ptr++] = (v); else Ep1Buffer[UpPoint1_Ptr++] = (v); }
+#else
+#define MPSSE_REPLY(chan, v) { Ep1Buffer[UpPoint1_Ptr++] = (v); }
+#endif
+
+/* 只编译接口A时是常数0, 只有接口A用到的分支会被去掉 */
+#define MPSSE_IS_B(chan)	(MPSSE_CHAN_B && (chan))
+
+/* 厂商指令, 只有接口A; 不是厂商指令时返回MPSSE_ERROR */
+uint8_t Mpsse_Vendor(uint8_t instr)
+{
+	switch(instr)
+	{
+		case MPSSE_VND_RLE:
+			Tap_Walk(TMS ? 0xff : 0x00, 8); /* 整字节移位, TMS保持不变 */
+			SPI_ON();
+			return MPSSE_RCV_LENGTH_L;
+		case MPSSE_VND_VERIFY:
+			Tap_Walk(TMS ? 0xff : 0x00, 8);
+			SPI_ON();
+			return MPSSE_RCV_FLAGS;
+		case MPSSE_VND_CHAIN:
+			SPI_OFF();
+			Chain_Scan();
+			return MPSSE_IDLE;
+	#if MPSSE_HWSPI
+		case MPSSE_VND_TUNE:
+			SPI_OFF();
+			return MPSSE_TUNE_FLAGS;
+	#endif
+	#if MPSSE_SWD
+		case MPSSE_VND_SWD:
+			SPI_OFF();
+			return MPSSE_SWD_COUNT;
+	#endif
+		case MPSSE_VND_SCAN:
+	#if MPSSE_XSVF
+		case MPSSE_VND_XSVF:
+	#endif
+			SPI_OFF();
+			return MPSSE_RCV_FLAGS;
+	}
+	if((instr & 0xf0) == MPSSE_VND_GOTO)
+	{
+		SPI_OFF();
+		Tap_Goto(instr & 0x0f);
+		return MPSSE_IDLE;
+	}
+	return MPSSE_ERROR;
+}
+
+/*
+ * 接口A和B共用的指令码处理, chan 0接口A, 1接口B; 返回下一个状态, 回传写到该接口的IN端点
+ * 返回MPSSE_ERROR(已回0xfa, 下一步回显指令)和MPSSE_WAIT_IO时指令字节留着, 其余由调用者消耗
+ * 0x87的刷新也由调用者做; 接口B没有SPI和RTCK, 厂商指令只有接口A支持
+ */
+uint8_t Mpsse_Opcode(uint8_t chan, uint8_t instr)
+{
+	uint8_t st;
+
+	switch(instr)
+	{
+		case 0x81: /* 低字节引脚, bit5是WAIT_IO, 等待超时后主机可以据此判断 */
+	#if MPSSE_CHAN_B
+			if(chan)
+				st = Chan_B_Read();
+			else
+	#endif
+			st = Bitbang_Read();
+			MPSSE_REPLY(chan, st);
+			return MPSSE_IDLE;
+		case 0x83: /* 高字节没有引脚, 假状态 */
+			MPSSE_REPLY(chan, 0x03);
+			return MPSSE_IDLE;
+		case 0x84:
+		case 0x85: /* Loopback */
+		case 0x87:
+			return MPSSE_IDLE;
+		case 0x96: /* 自适应时钟(RTCK), RTCK和接口B的CTS/TCK共用P3.2, 开着RTS_CTS流控或者双JTAG时忽略 */
+	#if !MPSSE_CHAN_B
+			if(Uart_Flow == 0)
+			{
+				Rtck_Enable = 1;
+				SPI_OFF();
+			}
+	#endif
+			return MPSSE_IDLE;
+		case 0x97:
+			if(!MPSSE_IS_B(chan))
+				Rtck_Enable = 0;
+			return MPSSE_IDLE;
+		case 0x88:
+		case 0x89:
+		case 0x94:
+		case 0x95: /* 等GPIOL1高/低, 0x94/0x95同时打TCK */
+			if(!MPSSE_IS_B(chan))
+				SPI_OFF();
+			Wait_Start[MPSSE_IS_B(chan)] = SOF_Count;
+			Wait_Abort[MPSSE_IS_B(chan)] = 0;
+			return MPSSE_WAIT_IO;
+	}
+
+	st = Mpsse_Cmd_State(instr);
+	if(st != MPSSE_IDLE)
+	{
+		if(!MPSSE_IS_B(chan))
+		{
+			if(st == MPSSE_RCV_LENGTH_L)
+			{
+				Tap_Walk(TMS ? 0xff : 0x00, 8); /* 整字节移位, TMS保持不变 */
+				SPI_ON();
+			}
+			else if(st == MPSSE_RCV_LENGTH)
+				SPI_OFF();
+		}
+		return st;
+	}
+	if(!MPSSE_IS_B(chan))
+	{
+		st = Mpsse_Vendor(instr);
+		if(st != MPSSE_ERROR)
+			return st;
+	}
+
+	/* 不支持的命令 */
+	MPSSE_REPLY(chan, 0xfa);
+	PERF_ADD(Bad_Opcode, 1);
+	return MPSSE_ERROR;
+}
+
+/* WAIT_IO等到了GPIOL1的电平, 或者超时/被SIO RESET放弃 */
+uint8_t Mpsse_Wait_Done(uint8_t chan, uint8_t instr)
+{
+	uint8_t i = MPSSE_IS_B(chan);
+
+	if(WAIT_IO == ((instr & 0x01) ? 0 : 1) || Wait_Abort[i])
+		return 1;
+	return WAIT_IO_TIMEOUT != 0 && (uint16_t) (SOF_Count - Wait_Start[i]) >= WAIT_IO_TIMEOUT;
+}
+
+#if MPSSE_CHAN_B
+/* 代替串口转发, 在主循环里处理EP4来的MPSSE指令, 回传走EP3; 译码和移位模板和接口A共用 */
+void Chan_B_Service(void)
+{
+	uint8_t budget, data, rcvdata, cnt;
+
+	for(budget = MPSSE_BUDGET; budget != 0; budget--)
+	{
+		if(USBReceived_1 == 0 || UpPoint3_Ptr >= 64 || UpPoint3_Busy)
+			break;
+		data = Ep4Buffer[USBOutPtr_1 - 64];
+		switch(B_Status)
+		{
+			case MPSSE_IDLE:
+				B_Instr = data;
+				B_Status = Mpsse_Opcode(1, data);
+				if(data == 0x87)
+				{
+					B_Purge = 1;
+					budget = 1;
+				}
+				if(B_Status != MPSSE_ERROR && B_Status != MPSSE_WAIT_IO)
+					USBOutPtr_1++;
+			break;
+			case MPSSE_WAIT_IO:
+				if(Mpsse_Wait_Done(1, B_Instr))
+				{
+					B_Status = MPSSE_IDLE;
+					USBOutPtr_1++;
+					break;
+				}
+				if(B_Instr & 0x10) /* 打8个TCK, TMS不变 */
+				{
+					data = B_TMS ? 0xff : 0x00;
+					cnt = 7;
+					KERNEL_BITS(B_TCK, B_TMS, B_TDO, cnt, 0, 0);
+				}
+				budget = 1;
+			break;
+			case MPSSE_NO_OP_1:
+				if(B_Instr == 0x80) /* 低字节: bit0 TCK, bit1 TDI, bit3 TMS */
+				{
+					B_TCK = (data & 0x01);
+					B_TDI = (data & 0x02) ? 1 : 0;
+					B_TMS = (data & 0x08) ? 1 : 0;
+				}
+				B_Status = MPSSE_NO_OP_2;
+				USBOutPtr_1++;
+			break;
+			case MPSSE_NO_OP_2:
+			case MPSSE_ERROR:
+				if(B_Status == MPSSE_ERROR)
+					Ep3Buffer[UpPoint3_Ptr++] = data;
+				B_Status = MPSSE_IDLE;
+				USBOutPtr_1++;
+			break;
+			case MPSSE_RCV_LENGTH_L:
+				B_LongLen = data;
+				B_Status = MPSSE_RCV_LENGTH_H;
+				USBOutPtr_1++;
+			break;
+			case MPSSE_RCV_LENGTH_H:
+				B_LongLen |= (data << 8) & 0xff00;
+				B_Status = Mpsse_Byte_State(B_Instr);
+				USBOutPtr_1++;
+			break;
+			case MPSSE_TRANSMIT_BYTE:
+			case MPSSE_TRANSMIT_BYTE_RD:
+			case MPSSE_TRANSMIT_BYTE_MSB:
+			case MPSSE_TRANSMIT_BYTE_MSB_RD:
+				cnt = 7;
+				KERNEL_BITS(B_TCK, B_TDI, B_TDO, cnt, MPSSE_CMD_MSB(B_Instr), 1);
+				if(MPSSE_CMD_RD(B_Instr))
+					Ep3Buffer[UpPoint3_Ptr++] = rcvdata;
+				if(B_LongLen == 0)
+					B_Status = MPSSE_IDLE;
+				B_LongLen--;
+				USBOutPtr_1++;
+			break;
+			case MPSSE_RCV_LENGTH:
+				B_ShortLen = data & 0x07;
+				B_Status = Mpsse_Bit_State(B_Instr);
+				USBOutPtr_1++;
+			break;
+			case MPSSE_TRANSMIT_BIT:
+			case MPSSE_TRANSMIT_BIT_RD:
+			case MPSSE_TRANSMIT_BIT_MSB:
+			case MPSSE_TRANSMIT_BIT_MSB_RD:
+				cnt = B_ShortLen;
+				KERNEL_BITS(B_TCK, B_TDI, B_TDO, cnt, MPSSE_CMD_MSB(B_Instr), 1);
+				if(MPSSE_CMD_RD(B_Instr))
+					Ep3Buffer[UpPoint3_Ptr++] = rcvdata;
+				B_Status = MPSSE_IDLE;
+				USBOutPtr_1++;
+			break;
+			case MPSSE_TMS_OUT:
+			case MPSSE_TMS_OUT_RD:
+				B_TDI = (data & 0x80) ? 1 : 0;
+				cnt = B_ShortLen;
+				KERNEL_BITS(B_TCK, B_TMS, B_TDO, cnt, 0, 1);
+				if(MPSSE_CMD_RD(B_Instr))
+					Ep3Buffer[UpPoint3_Ptr++] = rcvdata;
+				B_Status = MPSSE_IDLE;
+				USBOutPtr_1++;
+			break;
+			default:
+				B_Status = MPSSE_IDLE;
+			break;
+		}
+
+		if(USBOutPtr_1 >= USBOutLength_1)
 		{
-			INTF1_RTS = 0;
-			INTF1_DTR = 1;
+			USBReceived_1 = 0;
+			UEP4_CTRL = UEP4_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_ACK;
 		}
-		if(soft_dtr == soft_rts)
+	}
+
+	if(UpPoint3_Busy == 0)
+	{
+		if(UpPoint3_Ptr == 64 || (uint16_t) (SOF_Count - B_Timeout) >= Latency_Timer1 || B_Purge)
 		{
-			INTF1_DTR = 1;
-			INTF1_RTS = 0;
-			INTF1_RTS = 1;
+			B_Timeout = SOF_Count;
+			UpPoint3_Busy = 1;
+			Ep3Buffer[1] = MPSSE_LINE_STATUS(USBReceived_1);
+			UEP3_T_LEN = UpPoint3_Ptr;
+			UEP3_CTRL = UEP3_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
+			UpPoint3_Ptr = 2;
+			B_Purge = 0;
 		}
 	}
-	if(SOF_Count % 16 == 0)
-		PWM2 = 1;
 }
+#endif
 
-void init_timer() {
-    mTimer0Clk12DivFsys();	                                                   //T0定时器时钟设置,12MHz/12=1MHz
-    mTimer_x_ModInit(0,1);                                                     //T0 定时器模式设置
-    mTimer_x_SetData(0,1000);	                                               //T0定时器赋值,1MHz/1000=1000Hz, 1ms
-    mTimer0RunCTL(1);                                                          //T0定时器启动	
-    ET0 = 1;                                                                   //T0定时器中断开启		
-    EA = 1;
-
-	SOF_Count = 0;
-}
+#define MPSSE_BYTE_STATE(msb, rd) \
+	data = Ep2Buffer[USBOutPtr]; \
+	if(Rtck_Enable) \
+		rcvdata = msb ? Bit_Reverse(Rtck_Shift(Bit_Reverse(data), 8, 0)) : Rtck_Shift(data, 8, 0); \
+	else \
+		KERNEL_BYTE(msb, rd); \
+	if(rd) \
+		Ep1Buffer[UpPoint1_Ptr++] = rcvdata; \
+	USBOutPtr++; \
+	if(Mpsse_LongLen == 0) \
+		Mpsse_Status = MPSSE_IDLE; \
+	Mpsse_LongLen --;
+
+#define MPSSE_BITS_STATE(msb, rd) \
+	data = Ep2Buffer[USBOutPtr]; \
+	PERF_ADD(Mpsse_Bits, Mpsse_ShortLen + 1); \
+	if(Rtck_Enable) \
+	{ \
+		rcvdata = Rtck_Shift(msb ? Bit_Reverse(data) : data, Mpsse_ShortLen + 1, 0); \
+		if(msb) rcvdata = Bit_Reverse(rcvdata); \
+	} \
+	else \
+		KERNEL_BITS(TCK, MOSI, TDO, Mpsse_ShortLen, msb, rd); \
+	if(rd) \
+		Ep1Buffer[UpPoint1_Ptr++] = rcvdata; \
+	Mpsse_Status = MPSSE_IDLE; \
+	USBOutPtr++;
+
+#define MPSSE_TMS_STATE(rd) \
+	data = Ep2Buffer[USBOutPtr]; \
+	PERF_ADD(Mpsse_Bits, Mpsse_ShortLen + 1); \
+	Tap_Walk(data, Mpsse_ShortLen + 1); \
+	TDI = (data & 0x80) ? 1 : 0; \
+	if(Rtck_Enable) \
+		rcvdata = Rtck_Shift(data, Mpsse_ShortLen + 1, 1); \
+	else \
+		KERNEL_TMS(rd); \
+	if(rd) \
+		Ep1Buffer[UpPoint1_Ptr++] = rcvdata; \
+	Mpsse_Status = MPSSE_IDLE; \
+	USBOutPtr++;
 
-#if MPSSE_HWSPI
-#define SPI_LSBFIRST() SPI0_SETUP |= bS0_BIT_ORDER
-#define SPI_MSBFIRST() SPI0_SETUP &= ~bS0_BIT_ORDER
-#define SPI_ON() SPI0_CTRL = bS0_MISO_OE | bS0_MOSI_OE | bS0_SCK_OE;
-#define SPI_OFF() SPI0_CTRL = 0;
-#else
-#define SPI_LSBFIRST()
-#define SPI_MSBFIRST()
-#define SPI_ON()
-#define SPI_OFF()
-#endif
 //主函数
 main()
 {
 	uint8_t i;
 	uint8_t Purge_Buffer = 0;
+	uint8_t Uart_Flush = 0;
+	uint8_t budget;
 	uint8_t data, rcvdata;
 	uint8_t instr = 0;
 	volatile uint16_t Uart_Timeout = 0;
 	volatile uint16_t Uart_Timeout1 = 0;
 	uint16_t Esp_Stage = 0;
+	uint8_t usb_attached;
 	// int8_t size;
 
-	
+	usb_attached = USB_CTRL & bUC_DEV_PU_EN; /* 从bootloader跳过来时上拉还开着, 复位后为0 */
 	Xtal_Enable();	//启动振荡器
 	CfgFsys( );														   //CH552时钟选择配置
 	mDelaymS(5);														  //修改主频等待内部时钟稳定,必加
+	if(usb_attached)
+		mDelaymS(BOOT_DETACH_MS); /* 让主机看到断开 */
+#ifndef SOF_NO_TIMER
+	init_timer();                                                              // 每1ms SOF_Count加1
+#endif
+	USBDeviceCfg(); /* 尽早打开上拉, 主机要防抖100ms才复位总线, 下面的初始化来得及 */
 	CLKO_Enable();
 	JTAG_IO_Config();
+#if MPSSE_CHAN_B
+	Chan_B_IO_Config();
+#else
 	SerialPort_Config();
+#endif
 
 	PWM2 = 1;
 	
 #if MPSSE_HWSPI
 	SPI_Init();
 #endif
+	Settings_Load();
 
 #ifdef DE_PRINTF
 	printf("start ...\n");
 #endif
-	USBDeviceCfg();
 	USBDeviceEndPointCfg();											   //端点配置
 	USBDeviceIntCfg();													//中断初始化
 	UEP0_T_LEN = 0;
@@ -1462,278 +3848,423 @@ main()
 	UpPoint1_Ptr = 2;
 	UpPoint3_Ptr = 2;
 	XBUS_AUX = 0;
-#ifndef SOF_NO_TIMER
-	init_timer();                                                              // 每1ms SOF_Count加1
-#endif 
-	T1 = 0;
 	while(1)
 	{
+	#if LOGIC_CAPTURE
+		if(Capture_Run)
+			Capture_Loop();
+	#endif
+		if(Settings_Req)
+		{
+			if(Settings_Req == SETTINGS_REQ_SAVE)
+				Settings_Save();
+			else
+				Settings_Erase();
+			Settings_Req = 0;
+		}
+		if(Baud_Req)
+			Baud_Apply();
 		if(UsbConfig)
 		{
-			if(USBReceived == 1)
+		#if MPSSE_XSVF
+			if(USBReceived == 1 || Reply_Len != 0 || Bitbang_Pending || Xsvf_Wait != 0)
+		#else
+			if(USBReceived == 1 || Reply_Len != 0 || Bitbang_Pending)
+		#endif
 			{ //收到一包
-			#if MPSSE_DEBUG
-				if(UpPoint1_Ptr < 64 && UpPoint1_Busy == 0 && UpPoint3_Busy == 0 && UpPoint3_Ptr < 64) /* 可以发送 */
-			#else
-				if(UpPoint1_Ptr < 64 && UpPoint1_Busy == 0)
-			#endif
+				PWM2 = !PWM2;
+				/* MPSSE最多连续跑MPSSE_BUDGET字节, 然后让出给EP1/串口 */
+				for(budget = MPSSE_BUDGET; budget != 0; budget--)
 				{
-					PWM2 = !PWM2;
-						switch(Mpsse_Status)
+					if(Bitbang_Pending && (Mpsse_Status == MPSSE_IDLE || Mpsse_Status == MPSSE_BITBANG)) /* 只在指令之间切换模式, 没有新数据时也要切 */
+					{
+						Bitbang_Pending = 0;
+						SPI_OFF();
+						if(Bitbang_Mode & (BITMODE_BITBANG | BITMODE_SYNCBB))
+						{
+							Bitbang_Config();
+							Mpsse_Status = MPSSE_BITBANG;
+						}
+						else
 						{
-							case MPSSE_IDLE:
-								instr = Ep2Buffer[USBOutPtr];
+							JTAG_IO_Config();
+							Mpsse_Status = MPSSE_IDLE;
+						}
+					}
 			#if MPSSE_DEBUG
-								Ep3Buffer[UpPoint3_Ptr++] = instr;
+					if(UpPoint1_Ptr >= 64 || UpPoint1_Busy || UpPoint3_Busy || UpPoint3_Ptr >= 64) /* 无法发送 */
+			#else
+					if(UpPoint1_Ptr >= 64 || UpPoint1_Busy)
 			#endif
-								switch(instr)
-								{
-									case 0x80:
-									case 0x82: /* 假Bit bang模式 */
-										Mpsse_Status = MPSSE_NO_OP_1;
-										USBOutPtr++;
-									break;
-									case 0x81:
-									case 0x83: /* 假状态 */
-										Ep1Buffer[UpPoint1_Ptr++] = Ep2Buffer[USBOutPtr] - 0x80;
-										USBOutPtr++;
-									break;
-									case 0x84:
-									case 0x85: /* Loopback */
-										USBOutPtr++;
-									break;
-									case 0x86: /* 调速，暂时不支持 */
-										Mpsse_Status = MPSSE_NO_OP_1;
-										USBOutPtr++;
-									break;
-									case 0x87: /* 立刻刷新缓冲 */
-										Purge_Buffer = 1;
-										USBOutPtr++;
-									break;
-									case 0x19:
-									case 0x39:
-									case 0x11:
-									case 0x31:
-										SPI_ON();
-										Mpsse_Status = MPSSE_RCV_LENGTH_L;
-										USBOutPtr++;
-									break;
-									case 0x6b:
-									case 0x4b:
-									case 0x3b:
-									case 0x1b:
-									case 0x13:
-										SPI_OFF();
-										Mpsse_Status = MPSSE_RCV_LENGTH;
-										USBOutPtr++;
-									break;										
-									default:	/* 不支持的命令 */
-										Ep1Buffer[UpPoint1_Ptr++] = 0xfa;
-										Mpsse_Status = MPSSE_ERROR;
-									break;
-								}
-							break;
-							case MPSSE_RCV_LENGTH_L: /* 接收长度 */
-								Mpsse_LongLen = Ep2Buffer[USBOutPtr];
-								Mpsse_Status ++;
-								USBOutPtr++;
-							break;
-							case MPSSE_RCV_LENGTH_H:
-								Mpsse_LongLen |= (Ep2Buffer[USBOutPtr] << 8) & 0xff00;
+						break;
+					if(Reply_Len != 0) /* 先把厂商指令的回传送完 */
+					{
+						Ep1Buffer[UpPoint1_Ptr++] = Reply_Buf[Reply_Ptr++];
+						if(Reply_Ptr == Reply_Len)
+						{
+							Reply_Len = 0;
+							Reply_Ptr = 0;
+						}
+						continue;
+					}
+				#if MPSSE_XSVF
+					if(Xsvf_Wait != 0) /* XSVF的Run-Test还没等完, 后面的字节先不处理, 一段之后让出主循环 */
+					{
+						Xsvf_Wait_Step();
+						break;
+					}
+				#endif
+					if(USBReceived == 0)
+						break;
+					switch(Mpsse_Status)
+					{
+						case MPSSE_IDLE:
+							instr = Ep2Buffer[USBOutPtr];
+		#if MPSSE_DEBUG
+							Ep3Buffer[UpPoint3_Ptr++] = instr;
+		#endif
+							TRACE_PUT(TRACE_CMD_START, instr);
+							Mpsse_Status = Mpsse_Opcode(0, instr);
+							if(instr == 0x87) /* 立刻刷新缓冲 */
+							{
+								TRACE_PUT(TRACE_FLUSH, UpPoint1_Ptr - 2);
+								Purge_Buffer = 1;
+								budget = 1; /* 结束本轮, 马上发送 */
+							}
+							if(Mpsse_Status != MPSSE_ERROR && Mpsse_Status != MPSSE_WAIT_IO)
 								USBOutPtr++;
-						#if GOWIN_INT_FLASH_QUIRK
-								if((Mpsse_LongLen == 25000 || Mpsse_LongLen == 750 || Mpsse_LongLen == 2968) && (instr & (1 << 5)) == 0)
+						break;
+						case MPSSE_RCV_LENGTH_L: /* 接收长度 */
+							Mpsse_LongLen = Ep2Buffer[USBOutPtr];
+							Mpsse_Status ++;
+							USBOutPtr++;
+						break;
+						case MPSSE_RCV_LENGTH_H:
+							Mpsse_LongLen |= (Ep2Buffer[USBOutPtr] << 8) & 0xff00;
+							USBOutPtr++;
+							if(instr == MPSSE_VND_SCAN)
+							{
+								Tap_Goto((Mpsse_Flags & SCAN_IR) ? TAP_IRSHIFT : TAP_DRSHIFT);
+								TMS = 0;
+								if(Mpsse_LongLen >= 8)
 								{
-									SPI_OFF();
-									Run_Test_Start();
-									Mpsse_Status = MPSSE_RUN_TEST;
+									SPI_ON();
+									SPI_LSBFIRST();
 								}
-								else if(instr == 0x11 || instr == 0x31)
-						#else
-								if (instr == 0x11 || instr == 0x31)
-						#endif
-								{
-									Mpsse_Status = MPSSE_TRANSMIT_BYTE_MSB;
+								PERF_ADD(Mpsse_Bytes, Mpsse_LongLen >> 3);
+								Mpsse_Status = MPSSE_SCAN_DATA;
+							}
+					#if MPSSE_XSVF
+							else if(instr == MPSSE_VND_XSVF)
+							{
+								if(Mpsse_Flags & XSVF_START)
+									Xsvf_Start();
+								Mpsse_Status = MPSSE_XSVF_DATA;
+							}
+					#endif
+							else if(instr == MPSSE_VND_VERIFY)
+							{
+								if(Mpsse_Flags & VERIFY_START)
+									Verify_Start();
+							#if PERF_COUNTERS
+								Verify_Begin = Verify_Offset;
+							#endif
+								if(Mpsse_Flags & VERIFY_MSB)
 									SPI_MSBFIRST();
-								}
 								else
-								{
-									Mpsse_Status ++;
 									SPI_LSBFIRST();
-								}
-							break;
-							case MPSSE_TRANSMIT_BYTE:
-								data = Ep2Buffer[USBOutPtr];
+								Verify_Tdi = (Mpsse_Flags & VERIFY_TDI_ONES) ? 0xff : 0x00;
+								Verify_Phase = (Mpsse_Flags & VERIFY_TDI) ? VERIFY_PH_TDI : VERIFY_PH_EXP;
+								Mpsse_Status = MPSSE_VERIFY_DATA;
+							}
+							else if(instr == MPSSE_VND_RLE)
+							{
+								Mpsse_Flags = RLE_CTL;
+								SPI_LSBFIRST();
+								Mpsse_Status = MPSSE_RLE_DATA;
+							}
+					#if GOWIN_INT_FLASH_QUIRK
+							else if((Mpsse_LongLen == 25000 || Mpsse_LongLen == 750 || Mpsse_LongLen == 2968) && (instr & (1 << 5)) == 0)
+							{
+								SPI_OFF();
+								Run_Test_Start();
+								Mpsse_Status = MPSSE_RUN_TEST;
+							}
+					#endif
+							else
+							{
+								Mpsse_Status = Mpsse_Byte_State(instr);
+								if(MPSSE_CMD_MSB(instr))
+									SPI_MSBFIRST();
+								else
+									SPI_LSBFIRST();
+								PERF_ADD(Mpsse_Bytes, Mpsse_LongLen + 1); /* 性能计数按指令记, 不进每字节的循环 */
+							}
+						break;
+						case MPSSE_TRANSMIT_BYTE:
+							MPSSE_BYTE_STATE(0, 0);
+						break;
+						case MPSSE_TRANSMIT_BYTE_MSB:
+							MPSSE_BYTE_STATE(1, 0);
+						break;
+						case MPSSE_TRANSMIT_BYTE_RD:
+							MPSSE_BYTE_STATE(0, 1);
+						break;
+						case MPSSE_TRANSMIT_BYTE_MSB_RD:
+							MPSSE_BYTE_STATE(1, 1);
+						break;
+						case MPSSE_RCV_LENGTH:
+							Mpsse_ShortLen = Ep2Buffer[USBOutPtr] & 0x07;
+							Mpsse_Status = Mpsse_Bit_State(instr);
+							if(!MPSSE_CMD_TMS(instr))
+								Tap_Walk(TMS ? 0xff : 0x00, Mpsse_ShortLen + 1);
+							USBOutPtr++;
+						break;
+						case MPSSE_TRANSMIT_BIT:
+							MPSSE_BITS_STATE(0, 0);
+						break;
+						case MPSSE_TRANSMIT_BIT_RD:
+							MPSSE_BITS_STATE(0, 1);
+						break;
+						case MPSSE_TRANSMIT_BIT_MSB:
+							MPSSE_BITS_STATE(1, 0);
+						break;
+						case MPSSE_TRANSMIT_BIT_MSB_RD:
+							MPSSE_BITS_STATE(1, 1);
+						break;
+						case MPSSE_TMS_OUT:
+							MPSSE_TMS_STATE(0);
+						break;
+						case MPSSE_TMS_OUT_RD:
+							MPSSE_TMS_STATE(1);
+						break;
+						case MPSSE_ERROR:
+							Ep1Buffer[UpPoint1_Ptr++] = Ep2Buffer[USBOutPtr];
+							Mpsse_Status = MPSSE_IDLE;
+							USBOutPtr++;
+						break;
+						case MPSSE_NO_OP_1:
+							Mpsse_Status ++;
+							USBOutPtr++;
+						break;
+						case MPSSE_NO_OP_2:
+							Mpsse_Status = MPSSE_IDLE;
+							USBOutPtr++;
+						break;
+					#if MPSSE_HWSPI
+						case MPSSE_TUNE_FLAGS:
+							Tck_Tune(Ep2Buffer[USBOutPtr]);
+							Mpsse_Status = MPSSE_IDLE;
+							USBOutPtr++;
+						break;
+					#endif
+						case MPSSE_RCV_FLAGS:
+							Mpsse_Flags = Ep2Buffer[USBOutPtr];
+							Mpsse_Status = MPSSE_RCV_LENGTH_L;
+							USBOutPtr++;
+						break;
+						case MPSSE_SCAN_DATA:
+							data = Ep2Buffer[USBOutPtr];
+							if(Mpsse_LongLen >= 8)
+							{
 							#if MPSSE_HWSPI
-								SPI0_DATA = data;
-								while(S0_FREE == 0);
-								rcvdata = SPI0_DATA;
-							#else
-								rcvdata = 0;
-								for(i = 0; i < 8; i++)
+								if(Rtck_Enable == 0)
 								{
-									SCK = 0;
-									MOSI = (data & 0x01);
-									data >>= 1;
-									rcvdata >>= 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-									SCK = 1;
-									if(MISO == 1)
-										rcvdata |= 0x80;
-									__asm nop __endasm;
-									__asm nop __endasm;
+									SPI0_DATA = data;
+									while(S0_FREE == 0);
+									rcvdata = SPI0_DATA;
 								}
-								SCK = 0;
+								else
 							#endif
-								if(instr == 0x39)
-									Ep1Buffer[UpPoint1_Ptr++] = rcvdata;
-								USBOutPtr++;
-								if(Mpsse_LongLen == 0)
-									Mpsse_Status = MPSSE_IDLE;
-								Mpsse_LongLen --;							
-							break;
-							case MPSSE_TRANSMIT_BYTE_MSB:
-								data = Ep2Buffer[USBOutPtr];
-							#if MPSSE_HWSPI
-								SPI0_DATA = data;
-								while(S0_FREE == 0);
-								rcvdata = SPI0_DATA;								
-							#else
-								rcvdata = 0;
-								for(i = 0; i < 8; i++)
+								rcvdata = Jtag_Shift_Bits(data, 8, 0);
+								Mpsse_LongLen -= 8;
+							}
+							else
+							{
+								SPI_OFF();
+								rcvdata = Jtag_Shift_Bits(data, Mpsse_LongLen + 1, 1);
+								Tap_Goto(Mpsse_Flags >> 4);
+								Mpsse_Status = MPSSE_IDLE;
+							}
+							if(Mpsse_Flags & SCAN_READ)
+								Ep1Buffer[UpPoint1_Ptr++] = rcvdata;
+							USBOutPtr++;
+						break;
+						case MPSSE_VERIFY_DATA:
+							data = Ep2Buffer[USBOutPtr];
+							USBOutPtr++;
+							if(Verify_Phase == VERIFY_PH_TDI)
+							{
+								Verify_Tdi = data;
+								Verify_Phase = VERIFY_PH_EXP;
+								break;
+							}
+							if(Verify_Phase == VERIFY_PH_EXP)
+							{
+								Verify_Exp = data;
+								if(Mpsse_Flags & VERIFY_MASK)
 								{
-									SCK = 0;
-									MOSI = (data & 0x80);
-									data <<= 1;
-									rcvdata <<= 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-									SCK = 1;
-									if(MISO == 1)
-										rcvdata |= 0x01;
-									__asm nop __endasm;
-									__asm nop __endasm;
+									Verify_Phase = VERIFY_PH_MASK;
+									break;
 								}
-								SCK = 0;
-							#endif
-								if(instr == 0x31)
-									Ep1Buffer[UpPoint1_Ptr++] = rcvdata;
-								USBOutPtr++;
-								if(Mpsse_LongLen == 0)
-									Mpsse_Status = MPSSE_IDLE;
-								Mpsse_LongLen --;								
-							break;
-							case MPSSE_RCV_LENGTH:
-								Mpsse_ShortLen = Ep2Buffer[USBOutPtr];
-								if(instr == 0x6b || instr == 0x4b)
-									Mpsse_Status = MPSSE_TMS_OUT;
-								else if(instr == 0x13)
-									Mpsse_Status = MPSSE_TRANSMIT_BIT_MSB;
-								else
-									Mpsse_Status++;
-								USBOutPtr++;								
-							break;
-							case MPSSE_TRANSMIT_BIT:
-								data = Ep2Buffer[USBOutPtr];
-								rcvdata = 0;
-								do
-								{
-									SCK = 0;
-									MOSI = (data & 0x01);
-									data >>= 1;
-									rcvdata >>= 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-									SCK = 1;
-									if(MISO)
-										rcvdata |= 0x80;//(1 << (Mpsse_ShortLen));
-									__asm nop __endasm;
-									__asm nop __endasm;
-								} while((Mpsse_ShortLen--) > 0);
-								SCK = 0;
-								if(instr == 0x3b)
-									Ep1Buffer[UpPoint1_Ptr++] = rcvdata;
+								data = 0xff;
+							}
+							/* 记录收齐, data为mask */
+						#if MPSSE_HWSPI
+							if(Rtck_Enable == 0)
+							{
+								SPI0_DATA = Verify_Tdi;
+								while(S0_FREE == 0);
+								rcvdata = SPI0_DATA;
+							}
+							else
+						#endif
+							if(Mpsse_Flags & VERIFY_MSB)
+								rcvdata = Bit_Reverse(Jtag_Shift_Bits(Bit_Reverse(Verify_Tdi), 8, 0));
+							else
+								rcvdata = Jtag_Shift_Bits(Verify_Tdi, 8, 0);
+							Verify_Byte(rcvdata, data);
+							Verify_Phase = (Mpsse_Flags & VERIFY_TDI) ? VERIFY_PH_TDI : VERIFY_PH_EXP;
+							if(Mpsse_LongLen == 0)
+							{
+								PERF_ADD(Mpsse_Bytes, (uint16_t) Verify_Offset - Verify_Begin);
 								Mpsse_Status = MPSSE_IDLE;
-								USBOutPtr++;
-							break;
-							case MPSSE_TRANSMIT_BIT_MSB:
-								data = Ep2Buffer[USBOutPtr];
-								rcvdata = 0;
-								do
+								if(Mpsse_Flags & VERIFY_REPORT)
+									Verify_Report();
+							}
+							Mpsse_LongLen --;
+						break;
+					#if MPSSE_SWD
+						case MPSSE_SWD_COUNT:
+							Mpsse_ShortLen = Ep2Buffer[USBOutPtr];
+							Mpsse_Status = MPSSE_SWD_REQ;
+							USBOutPtr++;
+						break;
+						case MPSSE_SWD_REQ:
+						case MPSSE_SWD_DATA:
+							data = Ep2Buffer[USBOutPtr];
+							USBOutPtr++;
+							if(Mpsse_Status == MPSSE_SWD_REQ)
+							{
+								Mpsse_Flags = data;
+								if((data & SWD_REQ_RNW) == 0) /* 写, 先收4字节数据 */
 								{
-									SCK = 0;
-									MOSI = (data & 0x80);
-									data <<= 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-									SCK = 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-								} while((Mpsse_ShortLen--) > 0);
-								SCK = 0;
-
-								Mpsse_Status = MPSSE_IDLE;
-								USBOutPtr++;
-			
-							break;
-							case MPSSE_ERROR:
-								Ep1Buffer[UpPoint1_Ptr++] = Ep2Buffer[USBOutPtr];
+									Swd_Pos = 0;
+									Mpsse_Status = MPSSE_SWD_DATA;
+									break;
+								}
+							}
+							else
+							{
+								Swd_Buf[Swd_Pos++] = data;
+								if(Swd_Pos < 4)
+									break;
+							}
+							Swd_Run(Mpsse_Flags);
+							if(Mpsse_ShortLen == 0)
 								Mpsse_Status = MPSSE_IDLE;
-								USBOutPtr++;
-							break;
-							case MPSSE_TMS_OUT:
-								data = Ep2Buffer[USBOutPtr];
-								if(data & 0x80)
-									TDI = 1;
-								else
-									TDI = 0;
-								rcvdata = 0;
+							else
+								Mpsse_Status = MPSSE_SWD_REQ;
+							Mpsse_ShortLen --;
+						break;
+					#endif
+						case MPSSE_RLE_DATA:
+							data = Ep2Buffer[USBOutPtr];
+							if(Mpsse_Flags == RLE_CTL)
+							{
+								Rle_Count = data & 0x7f;
+								Mpsse_Flags = (data & 0x80) ? RLE_COUNT : RLE_LITERAL;
+								if(Mpsse_Flags == RLE_LITERAL)
+									PERF_ADD(Mpsse_Bytes, Rle_Count + 1);
+							}
+							else if(Mpsse_Flags == RLE_COUNT)
+							{
+								Rle_Count = (Rle_Count << 8) | data;
+								Mpsse_Flags = RLE_REPEAT;
+								PERF_ADD(Mpsse_Bytes, Rle_Count + 1);
+							}
+							else
+							{
+								/* 原样字节一次一个, 重复字节每步最多RLE_CHUNK个 */
+								i = (Mpsse_Flags == RLE_REPEAT) ? RLE_CHUNK : 1;
 								do
 								{
-									TCK = 0;
-									TMS = (data & 0x01);
-									data >>= 1;
-									rcvdata >>= 1;
-									__asm nop __endasm;
-									__asm nop __endasm;
-									SCK = 1;
-									if(TDO)
-										rcvdata |= 0x80;//(1 << (Mpsse_ShortLen));
-									__asm nop __endasm;
-									__asm nop __endasm;
-								} while((Mpsse_ShortLen--) > 0);
-								TCK = 0;
-								if(instr == 0x6b)
-									Ep1Buffer[UpPoint1_Ptr++] = rcvdata;
+								#if MPSSE_HWSPI
+									if(Rtck_Enable == 0)
+									{
+										SPI0_DATA = data;
+										while(S0_FREE == 0);
+									}
+									else
+								#endif
+									Jtag_Shift_Bits(data, 8, 0);
+									if(Rle_Count == 0)
+									{
+										Mpsse_Flags = RLE_CTL;
+										break;
+									}
+									Rle_Count--;
+								} while(--i);
+								if(Mpsse_Flags == RLE_REPEAT) /* 还没展开完, 不消耗输入, 下一步继续 */
+									break;
+							}
+							USBOutPtr++;
+							if(Mpsse_LongLen == 0)
 								Mpsse_Status = MPSSE_IDLE;
-								USBOutPtr++;
-							break;
-							case MPSSE_NO_OP_1:
-								Mpsse_Status ++;
-								USBOutPtr++;
-							break;
-							case MPSSE_NO_OP_2:
+							Mpsse_LongLen --;
+						break;
+					#if MPSSE_XSVF
+						case MPSSE_XSVF_DATA:
+							Xsvf_Feed(Ep2Buffer[USBOutPtr]);
+							USBOutPtr++;
+							if(Mpsse_LongLen == 0)
+								Mpsse_Status = MPSSE_IDLE;
+							Mpsse_LongLen --;
+						break;
+					#endif
+						case MPSSE_BITBANG: /* 每个字节输出到引脚, 同步模式先采样再输出, 采样回传 */
+							data = Ep2Buffer[USBOutPtr];
+							if(Bitbang_Mode & BITMODE_SYNCBB)
+								Ep1Buffer[UpPoint1_Ptr++] = Bitbang_Read();
+							Bitbang_Write(data);
+							if(Bitbang_Delay)
+								mDelayuS(Bitbang_Delay);
+							USBOutPtr++;
+						break;
+						case MPSSE_WAIT_IO: /* 不阻塞主循环, 指令字节留到等完再消耗, EP2也就不会重新开放 */
+							if(Mpsse_Wait_Done(0, instr))
+							{
 								Mpsse_Status = MPSSE_IDLE;
 								USBOutPtr++;
-							break;
-						#if GOWIN_INT_FLASH_QUIRK
-							case MPSSE_RUN_TEST:
-								if(Mpsse_LongLen == 0)
-								{
-									Mpsse_Status = MPSSE_IDLE;
-									Run_Test_Stop();
-								}
-									
-								USBOutPtr++;
-								Mpsse_LongLen --;
-							break;
-						#endif
-							default:
+								break;
+							}
+							if(instr & 0x10)
+							{
+								for(i = 8; i != 0; i--)
+									Jtag_Tms_Bit(TMS);
+							}
+							budget = 1; /* 让出给EP1/串口, 下一轮再看 */
+						break;
+					#if GOWIN_INT_FLASH_QUIRK
+						case MPSSE_RUN_TEST:
+							if(Mpsse_LongLen == 0)
+							{
 								Mpsse_Status = MPSSE_IDLE;
-							break;
-						}
-						
+								Run_Test_Stop();
+							}
+								
+							USBOutPtr++;
+							Mpsse_LongLen --;
+						break;
+					#endif
+						default:
+							Mpsse_Status = MPSSE_IDLE;
+						break;
+					}
+				#if TRACE
+					if(Mpsse_Status == MPSSE_IDLE)
+						TRACE_PUT(TRACE_CMD_END, instr);
+				#endif
 					
 					if(USBOutPtr >= USBOutLength)
 					{ //接收完毕
@@ -1749,57 +4280,93 @@ main()
 				if(UpPoint1_Ptr == 64)
 				{
 					UpPoint1_Busy = 1;
+					Ep1Buffer[1] = MPSSE_LINE_STATUS(USBReceived);
 					UEP1_T_LEN = 64;
 					UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
 					UpPoint1_Ptr = 2;
+					PERF_ADD(Ep1_Full, 1);
 				}
 				else if((uint16_t) (SOF_Count - Uart_Timeout) >= Latency_Timer || Purge_Buffer == 1) //超时
 				{
 					Uart_Timeout = SOF_Count;
 
 					UpPoint1_Busy = 1;
+					Ep1Buffer[1] = MPSSE_LINE_STATUS(USBReceived);
 					UEP1_T_LEN = UpPoint1_Ptr;
 					UEP1_CTRL = UEP1_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;			//应答ACK
 					UpPoint1_Ptr = 2;
 					Purge_Buffer = 0;
+					PERF_ADD(Ep1_Timeout, 1);
 				}
 			}
 
+		#if MPSSE_CHAN_B
+			Chan_B_Service();
+		#else
+		#if TRACE
+			if(Uart_Overrun != Trace_Overrun)
+			{
+				Trace_Overrun = Uart_Overrun;
+				TRACE_PUT(TRACE_UART_OVERRUN, Trace_Overrun & 0xff);
+			}
+		#endif
+
 			if(UpPoint3_Busy == 0)
 			{
-				int8_t size = WritePtr - ReadPtr;
-				if(size < 0) size = size + sizeof(RingBuf);//求余数
+				uint8_t size;
 
-				if(size >= 62)
+				if(Uart_Event) //收到事件字符, 不等Latency Timer
 				{
-					for(i = 0; i < 62; i++)
-					{
-						Ep3Buffer[2 + i] = RingBuf[ReadPtr++];
-						ReadPtr %= sizeof(RingBuf);
-					}
-					UpPoint3_Busy = 1;
-					UEP3_T_LEN = 64;
-					UEP3_CTRL = UEP3_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;
-					UpPoint3_Ptr = 2;
-
+					Uart_Event = 0;
+					Uart_Timeout1 = SOF_Count;
+					Uart_Flush = 1;
 				}
-				else if((uint16_t) (SOF_Count - Uart_Timeout1) >= Latency_Timer1) //超时
+				else if(Uart_Flush == 0 && (uint16_t) (SOF_Count - Uart_Timeout1) >= Latency_Timer1) //超时
 				{
 					Uart_Timeout1 = SOF_Count;
-					if(size > 62) size = 62;
-					for(i = 0; i < (uint8_t)size; i++)
+					Uart_Flush = 1;
+				}
+				size = (WritePtr - ReadPtr) & (sizeof(RingBuf) - 1); /* 在看过Uart_Event之后再取, 事件字符一定在里面 */
+
+				/* 过水位或超时才搬运, 每轮最多UART_BUDGET字节 */
+				if(size >= UART_WATERMARK || Uart_Flush)
+				{
+					i = 64 - UpPoint3_Ptr;
+					if(i > size) i = size;
+					if(i > UART_BUDGET) i = UART_BUDGET;
+					size -= i;
+					for(; i != 0; i--)
 					{
-						Ep3Buffer[2 + i] = RingBuf[ReadPtr++];
+						Ep3Buffer[UpPoint3_Ptr++] = RingBuf[ReadPtr++];
 						ReadPtr %= sizeof(RingBuf);
 					}
+				}
+
+				if(UART_RTS && size <= UART_RTS_LOW) //流控, 放开RTS
+					UART_RTS = 0;
+
+				if(UpPoint3_Ptr == 64 || (Uart_Flush && size == 0))
+				{
+					if(UpPoint3_Ptr == 64)
+						PERF_ADD(Ep3_Full, 1);
+					else
+						PERF_ADD(Ep3_Timeout, 1);
 					UpPoint3_Busy = 1;
-					// UEP3_T_LEN = UpPoint3_Ptr;
-					UEP3_T_LEN = 2 + size;
+					Ep3Buffer[0] = UART_MODEM_STATUS();
+					Ep3Buffer[1] = Uart_Line_Status();
+					UEP3_T_LEN = UpPoint3_Ptr;
 					UpPoint3_Ptr = 2;
+					Uart_Flush = 0;
 					UEP3_CTRL = UEP3_CTRL & ~ MASK_UEP_T_RES | UEP_T_RES_ACK;			//应答ACK
 				}
 			}
 
+			if(Uart_Tx_Paused && (Uart_Flow == 0 || UART_CTS == 0))
+			{
+				Uart_Tx_Paused = 0;
+				TI = 1;
+			}
+
 			if(USBReceived_1) //IDLE状态
 			{
 				if(Serial_Done == 0) //串口IDLE
@@ -1822,6 +4389,8 @@ main()
 				UEP4_CTRL = UEP4_CTRL & ~ MASK_UEP_R_RES | UEP_R_RES_ACK;
 			}
 
+		#endif
+
 			if(Require_DFU)
 			{
 				Require_DFU = 0;
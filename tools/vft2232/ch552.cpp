@@ -0,0 +1,685 @@
+/*
+ * vft2232: CH552 model, the hardware behind the SFRs of include/ch554.h.
+ *
+ * Modelled: P1/P3 pins wired to two TAP chains, SPI0 master, Timer0 (mode 1
+ * and 2, on the host clock), the interrupt controller with two priority
+ * levels, DataFlash writes and the USB device controller (SIE) for EP0-EP4.
+ * Not modelled: UART0/UART1 data, Timer1/Timer2 (baud rate, T2 clock out),
+ * PWM, ADC, the watchdog and the bootloader jump.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <atomic>
+
+#include "include/ch554.h"
+#include "include/debug.h"
+#include "model.h"
+#include "tap.h"
+
+int fw_main(void);
+
+#define VECTOR(num, fn) void fn(void);
+#include "vectors.inc"
+#undef VECTOR
+
+uint8_t Code_Space[0x10000];
+
+static volatile uint8_t Sfr_Mem[0x200];
+static model::Options Opt;
+static pthread_t Cpu_Thread;
+
+static Tap_Chain Chain_A;	/* TCK P1.7, TMS P1.1, TDI P1.5, TDO P1.6 */
+static Tap_Chain Chain_B;	/* TCK P3.2, TMS P3.5, TDI P3.1, TDO P3.0 */
+static uint8_t Spi_Rx;
+
+uint64_t model::now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint8_t Reg(const Sfr &r) { return Sfr_Mem[r.addr]; }
+static inline bool Bit(const Sbit &b) { return (Sfr_Mem[b.addr] & b.mask) != 0; }
+static inline void Set_Flag(const Sbit &b) { __atomic_fetch_or(&Sfr_Mem[b.addr], b.mask, __ATOMIC_SEQ_CST); }
+
+static void Irq_Check(void);
+
+/*******************************************************************************
+* Timer0
+*******************************************************************************/
+static uint64_t T0_Ref;
+static volatile sig_atomic_t T0_Busy;
+
+static uint32_t T0_Rate(void)
+{
+	uint8_t m = Reg(T2MOD);
+
+	if((m & bT0_CLK) == 0)
+		return FREQ_SYS / 12;
+	return (m & bTMR_CLK) ? FREQ_SYS : FREQ_SYS / 4;
+}
+
+/* 按经过的时间推进TL0/TH0, 溢出置TF0 */
+static void T0_Update(void)
+{
+	if(T0_Busy)
+		return;
+	T0_Busy = 1;
+	uint64_t now = model::now_ns();
+	if(Bit(TR0) == 0)
+		T0_Ref = now;
+	else
+	{
+		uint32_t rate = T0_Rate();
+		uint64_t ticks = (now - T0_Ref) * rate / 1000000000ull;
+		T0_Ref += ticks * 1000000000ull / rate;
+		if(ticks)
+		{
+			bool ovf = false;
+			if((Reg(TMOD) & MASK_T0_MOD) == 2)
+			{
+				uint32_t period = 256 - Reg(TH0);
+				uint64_t tl = Reg(TL0) + ticks;
+				if(tl >= 256)
+				{
+					ovf = true;
+					tl = Reg(TH0) + (tl - 256) % period;
+				}
+				Sfr_Mem[TL0.addr] = tl;
+			}
+			else
+			{
+				uint64_t t = ((Reg(TH0) << 8) | Reg(TL0)) + ticks;
+				if(t >= 0x10000)
+				{
+					ovf = true;
+					t &= 0xffff;
+				}
+				Sfr_Mem[TL0.addr] = t;
+				Sfr_Mem[TH0.addr] = t >> 8;
+			}
+			if(ovf)
+				Set_Flag(TF0);
+		}
+	}
+	T0_Busy = 0;
+}
+
+/*******************************************************************************
+* 引脚
+*******************************************************************************/
+static bool Chan_B_Active(void)
+{
+	/* P3.2推挽输出时是接口B的TCK, 否则是RTCK/CTS输入 */
+	return (Reg(P3_MOD_OC) & (1 << 2)) == 0;
+}
+
+static uint8_t Pins_P1(void)
+{
+	uint8_t v = Reg(P1);
+
+	v = (v & ~(1 << 6)) | (Chain_A.Tdo() << 6);
+	return v;
+}
+
+static uint8_t Pins_P3(void)
+{
+	uint8_t v = Reg(P3);
+
+	if(Chan_B_Active())
+		v = (v & ~0x01) | Chain_B.Tdo();
+	else
+	{
+		/* RXD空闲为高, RTCK跟着TCK, 不接时被上拉 */
+		v |= 0x01;
+		if(Opt.rtck)
+			v = (v & ~(1 << 2)) | ((Reg(P1) >> 7) << 2);
+	}
+	if(Opt.wait_io == 0)
+		v &= ~(1 << 3);
+	return v;
+}
+
+static void Pins_Changed(uint16_t addr)
+{
+	uint8_t v = Sfr_Mem[addr];
+
+	if(addr == P1.addr)
+		Chain_A.Clock(v & 0x80, v & 0x02, v & 0x20);
+	else if(addr == P3.addr && Chan_B_Active())
+		Chain_B.Clock(v & 0x04, v & 0x20, v & 0x02);
+}
+
+/* SPI0主机: 每位先出TDI, 上升沿读TDO, 和SCK空闲为低(模式0)一样 */
+static void Spi_Transfer(uint8_t out)
+{
+	bool lsb = (Reg(SPI0_SETUP) & bS0_BIT_ORDER) != 0;
+	uint8_t in = 0;
+	int tms = (Reg(P1) >> 1) & 1;
+
+	for(int i = 0; i < 8; i++)
+	{
+		int n = lsb ? i : 7 - i;
+		int tdi = (out >> n) & 1;
+		in |= Chain_A.Tdo() << n;
+		Chain_A.Clock(1, tms, tdi);
+		Chain_A.Clock(0, tms, tdi);
+	}
+	Spi_Rx = in;
+}
+
+/*******************************************************************************
+* DataFlash
+*******************************************************************************/
+static void Flash_Save(void)
+{
+	FILE *f;
+
+	if(Opt.flash_file == nullptr || (f = fopen(Opt.flash_file, "wb")) == nullptr)
+		return;
+	fwrite(Code_Space + DATA_FLASH_ADDR, 1, 256, f);
+	fclose(f);
+}
+
+static void Flash_Load(void)
+{
+	FILE *f;
+
+	memset(Code_Space + DATA_FLASH_ADDR, 0xff, 256);
+	if(Opt.flash_file == nullptr || (f = fopen(Opt.flash_file, "rb")) == nullptr)
+		return;
+	if(fread(Code_Space + DATA_FLASH_ADDR, 1, 256, f) != 256)
+		memset(Code_Space + DATA_FLASH_ADDR, 0xff, 256);
+	fclose(f);
+}
+
+/*******************************************************************************
+* SFR读写
+*******************************************************************************/
+uint8_t sfr_latch(uint16_t addr)
+{
+	if(addr == TCON.addr || addr == TL0.addr || addr == TH0.addr)
+		T0_Update();
+	return Sfr_Mem[addr];
+}
+
+uint8_t sfr_read(uint16_t addr)
+{
+	switch(addr)
+	{
+	case P1.addr:
+		return Pins_P1();
+	case P3.addr:
+		return Pins_P3();
+	case SPI0_DATA.addr:
+		return Spi_Rx;
+	case SPI0_STAT.addr:
+		return Sfr_Mem[addr] | 0x08;	/* S0_FREE, 传输在写SPI0_DATA时就做完了 */
+	case ROM_STATUS.addr:
+		return bROM_ADDR_OK;
+	case TCON.addr:
+	{
+		bool tf = Bit(TF0);
+		T0_Update();
+		if(tf == false && Bit(TF0))
+			Irq_Check();
+		return Sfr_Mem[addr];
+	}
+	}
+	return sfr_latch(addr);
+}
+
+static void Sfr_Written(uint16_t addr, uint8_t old)
+{
+	uint8_t v = Sfr_Mem[addr];
+
+	switch(addr)
+	{
+	case P1.addr:
+	case P3.addr:
+		Pins_Changed(addr);
+		break;
+	case SPI0_DATA.addr:
+		if(Reg(SPI0_CTRL) & bS0_SCK_OE)
+			Spi_Transfer(v);
+		break;
+	case ROM_CTRL.addr:
+		if(v == ROM_CMD_WRITE && (Reg(GLOBAL_CFG) & bDATA_WE))
+		{
+			Code_Space[(Reg(ROM_ADDR_H) << 8) | Reg(ROM_ADDR_L)] = Reg(ROM_DATA_L);
+			Flash_Save();
+		}
+		break;
+	case SBUF.addr:
+		Set_Flag(TI);	/* 串口0的数据不模拟, 立刻发完 */
+		break;
+	case TCON.addr:
+		if((old ^ v) & (1 << 4))
+			T0_Ref = model::now_ns();
+		Irq_Check();
+		break;
+	case IE.addr:
+	case IP.addr:
+	case IE_EX.addr:
+	case IP_EX.addr:
+	case SCON.addr:
+	case SCON1.addr:
+	case USB_INT_EN.addr:
+		Irq_Check();
+		break;
+	}
+}
+
+void sfr_write(uint16_t addr, uint8_t val)
+{
+	if(addr == TCON.addr || addr == TL0.addr || addr == TH0.addr || addr == TMOD.addr || addr == T2MOD.addr)
+		T0_Update();
+	/* USB中断标志写1清零 */
+	if(addr == USB_INT_FG.addr)
+	{
+		__atomic_fetch_and(&Sfr_Mem[addr], (uint8_t) ~(val & 0x1f), __ATOMIC_SEQ_CST);
+		return;
+	}
+	uint8_t old = Sfr_Mem[addr];
+	Sfr_Mem[addr] = val;
+	Sfr_Written(addr, old);
+}
+
+void sfr_bit(uint16_t addr, uint8_t mask, uint8_t val)
+{
+	uint8_t old;
+
+	if(addr == TCON.addr)
+		T0_Update();
+	/* USB中断标志只能清零 */
+	if(addr == USB_INT_FG.addr && val)
+		return;
+	if(val)
+		old = __atomic_fetch_or(&Sfr_Mem[addr], mask, __ATOMIC_SEQ_CST);
+	else
+		old = __atomic_fetch_and(&Sfr_Mem[addr], (uint8_t) ~mask, __ATOMIC_SEQ_CST);
+	Sfr_Written(addr, old);
+}
+
+/*******************************************************************************
+* 中断: 两级优先级, 同级按中断号
+*******************************************************************************/
+static void (*Vector_Table[14])(void);
+static volatile int Cur_Level = -1;
+static volatile sig_atomic_t In_Dispatch, Redo;
+
+static bool Irq_Pending(int n)
+{
+	switch(n)
+	{
+	case INT_NO_INT0: return Bit(IE0) && Bit(EX0);
+	case INT_NO_TMR0: return Bit(TF0) && Bit(ET0);
+	case INT_NO_INT1: return Bit(IE1) && Bit(EX1);
+	case INT_NO_TMR1: return Bit(TF1) && Bit(ET1);
+	case INT_NO_UART0: return (Bit(TI) || Bit(RI)) && Bit(ES);
+	case INT_NO_TMR2: return (Bit(TF2) || Bit(EXF2)) && Bit(ET2);
+	case INT_NO_USB: return (Reg(USB_INT_FG) & Reg(USB_INT_EN) & 0x07) && Bit(IE_USB);
+	case INT_NO_UART1: return (Bit(U1TI) || Bit(U1RI)) && Bit(IE_UART1);
+	}
+	return false;
+}
+
+static int Irq_Level(int n)
+{
+	static const uint8_t Ex_Bit[14] = { 0, 0, 0, 0, 0, 0, bIP_SPI0, bIP_TKEY, bIP_USB, bIP_ADC, bIP_UART1, bIP_PWMX, bIP_GPIO, 0 };
+
+	if(n < 6)
+		return (Reg(IP) >> n) & 1;
+	return (Reg(IP_EX) & Ex_Bit[n]) ? 1 : 0;
+}
+
+static int Irq_Pick(void)
+{
+	int best = -1, best_level = Cur_Level;
+
+	if(Bit(EA) == 0 || Bit(E_DIS))
+		return -1;
+	for(int n = 0; n < 14; n++)
+	{
+		if(Vector_Table[n] == nullptr || Irq_Pending(n) == false)
+			continue;
+		int level = Irq_Level(n);
+		if(level > best_level)
+		{
+			best = n;
+			best_level = level;
+		}
+	}
+	return best;
+}
+
+static void Irq_Check(void)
+{
+	if(In_Dispatch)
+	{
+		Redo = 1;
+		return;
+	}
+	In_Dispatch = 1;
+	for(;;)
+	{
+		Redo = 0;
+		int n = Irq_Pick();
+		if(n < 0)
+		{
+			if(Redo)
+				continue;
+			break;
+		}
+		/* 进中断时硬件清除的标志 */
+		if(n == INT_NO_TMR0)
+			sfr_bit(TCON.addr, TF0.mask, 0);
+		else if(n == INT_NO_TMR1)
+			sfr_bit(TCON.addr, TF1.mask, 0);
+		else if(n == INT_NO_INT0 && Bit(IT0))
+			sfr_bit(TCON.addr, IE0.mask, 0);
+		else if(n == INT_NO_INT1 && Bit(IT1))
+			sfr_bit(TCON.addr, IE1.mask, 0);
+		int saved = Cur_Level;
+		Cur_Level = Irq_Level(n);
+		In_Dispatch = 0;
+		Vector_Table[n]();
+		In_Dispatch = 1;
+		Cur_Level = saved;
+	}
+	In_Dispatch = 0;
+}
+
+/*******************************************************************************
+* USB设备控制器
+*******************************************************************************/
+enum
+{
+	SIE_IDLE,
+	SIE_POSTED,
+	SIE_BUSY,
+	SIE_DONE,
+};
+
+enum
+{
+	TOK_SETUP,
+	TOK_OUT,
+	TOK_IN,
+	TOK_RESET,
+};
+
+static struct
+{
+	std::atomic<int> state;
+	int token;
+	int ep;
+	uint8_t data[64];
+	int len;
+	int result;
+} Sie;
+
+static bool Bus_Enabled;
+static uint64_t Last_Sof;
+
+static uint8_t Ep_Ctrl(int ep)
+{
+	static const uint16_t Ctrl[5] = { UEP0_CTRL.addr, UEP1_CTRL.addr, UEP2_CTRL.addr, UEP3_CTRL.addr, UEP4_CTRL.addr };
+
+	return Sfr_Mem[Ctrl[ep]];
+}
+
+static uint8_t Ep_T_Len(int ep)
+{
+	static const uint16_t Len[5] = { UEP0_T_LEN.addr, UEP1_T_LEN.addr, UEP2_T_LEN.addr, UEP3_T_LEN.addr, UEP4_T_LEN.addr };
+
+	return Sfr_Mem[Len[ep]];
+}
+
+/* 端点缓冲区: 收发都开时发送缓冲区在接收缓冲区后面64字节, EP4跟在EP0后面 */
+static uint8_t *Ep_Buf(int ep, bool tx)
+{
+	uint16_t dma;
+	uint8_t rx_en = 0, tx_en = 0;
+
+	switch(ep)
+	{
+	case 0:
+		return XRAM_BASE + (uint16_t) UEP0_DMA;
+	case 1:
+		dma = UEP1_DMA;
+		rx_en = Reg(UEP4_1_MOD) & bUEP1_RX_EN;
+		tx_en = Reg(UEP4_1_MOD) & bUEP1_TX_EN;
+		break;
+	case 2:
+		dma = UEP2_DMA;
+		rx_en = Reg(UEP2_3_MOD) & bUEP2_RX_EN;
+		tx_en = Reg(UEP2_3_MOD) & bUEP2_TX_EN;
+		break;
+	case 3:
+		dma = UEP3_DMA;
+		rx_en = Reg(UEP2_3_MOD) & bUEP3_RX_EN;
+		tx_en = Reg(UEP2_3_MOD) & bUEP3_TX_EN;
+		break;
+	default:
+		dma = (uint16_t) UEP0_DMA + 64;
+		rx_en = Reg(UEP4_1_MOD) & bUEP4_RX_EN;
+		tx_en = Reg(UEP4_1_MOD) & bUEP4_TX_EN;
+		break;
+	}
+	if(tx && rx_en && tx_en)
+		dma += 64;
+	return XRAM_BASE + dma;
+}
+
+static void Sie_Done(int token, int ep, int len)
+{
+	Sfr_Mem[USB_RX_LEN.addr] = len;
+	Sfr_Mem[USB_INT_ST.addr] = bUIS_TOG_OK | token | ep;
+	Set_Flag(U_TOG_OK);
+	Set_Flag(UIF_TRANSFER);
+}
+
+/* 一次事务, 中断标志没清之前SIE忙, 对主机回NAK */
+static int Sie_Transaction(void)
+{
+	uint8_t ctrl;
+
+	if(Sie.token == TOK_RESET)
+	{
+		Bus_Enabled = true;
+		Last_Sof = model::now_ns();
+		Set_Flag(UIF_BUS_RST);
+		return model::USB_ACK;
+	}
+	if((Reg(USB_CTRL) & bUC_DEV_PU_EN) == 0 || Sie.ep > 4)
+		return model::USB_STALL;
+	if(Bit(UIF_TRANSFER))
+		return model::USB_NAK;
+	ctrl = Ep_Ctrl(Sie.ep);
+	switch(Sie.token)
+	{
+	case TOK_SETUP:
+		memcpy(Ep_Buf(0, false), Sie.data, 8);
+		Sie_Done(UIS_TOKEN_SETUP, 0, 8);
+		return model::USB_ACK;
+	case TOK_OUT:
+		if((ctrl & MASK_UEP_R_RES) == UEP_R_RES_STALL)
+			return model::USB_STALL;
+		if((ctrl & MASK_UEP_R_RES) != UEP_R_RES_ACK)
+			return model::USB_NAK;
+		memcpy(Ep_Buf(Sie.ep, false), Sie.data, Sie.len);
+		Sie_Done(UIS_TOKEN_OUT, Sie.ep, Sie.len);
+		return model::USB_ACK;
+	default:
+	{
+		if((ctrl & MASK_UEP_T_RES) == UEP_T_RES_STALL)
+			return model::USB_STALL;
+		if((ctrl & MASK_UEP_T_RES) != UEP_T_RES_ACK)
+			return model::USB_NAK;
+		int len = Ep_T_Len(Sie.ep);
+		if(len > Sie.len)
+			len = Sie.len;
+		memcpy(Sie.data, Ep_Buf(Sie.ep, true), len);
+		Sie_Done(UIS_TOKEN_IN, Sie.ep, 0);
+		return len;
+	}
+	}
+}
+
+static void Sof(void)
+{
+	uint64_t now = model::now_ns();
+
+	if(Bus_Enabled == false || now - Last_Sof < 1000000)
+		return;
+	Last_Sof += 1000000;
+	if(now - Last_Sof > 10000000)
+		Last_Sof = now;
+	if((Reg(USB_CTRL) & bUC_DEV_PU_EN) && (Reg(USB_INT_EN) & bUIE_DEV_SOF) && Bit(UIF_TRANSFER) == 0)
+	{
+		Sfr_Mem[USB_INT_ST.addr] = UIS_TOKEN_SOF;
+		Set_Flag(UIF_TRANSFER);
+	}
+}
+
+/* CPU线程上的"硬件": 定时器, SIE, 然后看有没有中断要进 */
+static void Hw_Signal(int)
+{
+	int e = errno;
+	int expect = SIE_POSTED;
+
+	T0_Update();
+	if(Sie.state.compare_exchange_strong(expect, SIE_BUSY))
+	{
+		Sie.result = Sie_Transaction();
+		Sie.state = SIE_DONE;
+	}
+	Sof();
+	Irq_Check();
+	errno = e;
+}
+
+static int Sie_Post(int token, int ep, const uint8_t *data, int len)
+{
+	if(token != TOK_IN && len)
+		memcpy(Sie.data, data, len);
+	Sie.token = token;
+	Sie.ep = ep;
+	Sie.len = len;
+	Sie.state = SIE_POSTED;
+	pthread_kill(Cpu_Thread, SIGUSR1);
+	while(Sie.state != SIE_DONE)
+		;
+	Sie.state = SIE_IDLE;
+	return Sie.result;
+}
+
+bool model::attached(void)
+{
+	return (Reg(USB_CTRL) & bUC_DEV_PU_EN) != 0;
+}
+
+void model::usb_bus_reset(void)
+{
+	Sie_Post(TOK_RESET, 0, nullptr, 0);
+}
+
+int model::usb_setup(const uint8_t setup[8])
+{
+	return Sie_Post(TOK_SETUP, 0, setup, 8);
+}
+
+int model::usb_out(int ep, const uint8_t *data, int len)
+{
+	return Sie_Post(TOK_OUT, ep, data, len);
+}
+
+int model::usb_in(int ep, uint8_t *buf, int max)
+{
+	int r = Sie_Post(TOK_IN, ep, nullptr, max > 64 ? 64 : max);
+
+	if(r > 0)
+		memcpy(buf, Sie.data, r);
+	return r;
+}
+
+void model::tick(void)
+{
+	pthread_kill(Cpu_Thread, SIGUSR1);
+}
+
+/*******************************************************************************
+* 启动
+*******************************************************************************/
+void model::init(const Options &opt)
+{
+	Opt = opt;
+	if(mmap(XRAM_BASE, XRAM_SIZE_MODEL, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != XRAM_BASE)
+	{
+		perror("vft2232: xdata mapping");
+		exit(1);
+	}
+	/* 芯片唯一ID */
+	static const uint8_t Uuid[6] = { 0x52, 0x55, 0x48, 0x43, 0x32, 0x35 };
+	memcpy(Code_Space + 0x3ffa, Uuid, sizeof(Uuid));
+	Flash_Load();
+	Chain_A.Set_Devices(Opt.idcodes);
+	Chain_B.Set_Devices(Opt.idcodes_b);
+	/* 复位值 */
+	Sfr_Mem[P1.addr] = 0xff;
+	Sfr_Mem[P3.addr] = 0xff;
+	Sfr_Mem[SPI0_CK_SE.addr] = 0x20;
+
+#define VECTOR(num, fn) Vector_Table[num] = fn;
+#include "vectors.inc"
+#undef VECTOR
+
+	Cpu_Thread = pthread_self();
+	struct sigaction sa = {};
+	sa.sa_handler = Hw_Signal;
+	sa.sa_flags = SA_NODEFER | SA_RESTART;
+	sigaction(SIGUSR1, &sa, nullptr);
+}
+
+[[noreturn]] void model::run_cpu(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+	fw_main();
+	fprintf(stderr, "vft2232: main() returned\n");
+	exit(1);
+}
+
+/*******************************************************************************
+* debug.h
+*******************************************************************************/
+void CfgFsys(void)
+{
+}
+
+void mDelayuS(uint16_t n)
+{
+	uint64_t end = model::now_ns() + n * 1000ull;
+
+	while(model::now_ns() < end)
+		;
+}
+
+void mDelaymS(uint16_t n)
+{
+	while(n--)
+		mDelayuS(1000);
+}
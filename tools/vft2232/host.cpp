@@ -0,0 +1,117 @@
+/*
+ * vft2232: USB host side of the rig, talks to the modelled SIE token by token.
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <mutex>
+
+#include "host.h"
+#include "model.h"
+
+static std::mutex Sie_Lock;
+
+static int Token(int kind, int ep, uint8_t *data, int len)
+{
+	std::lock_guard<std::mutex> g(Sie_Lock);
+
+	switch(kind)
+	{
+	case 0:
+		return model::usb_setup(data);
+	case 1:
+		return model::usb_out(ep, data, len);
+	default:
+		return model::usb_in(ep, data, len);
+	}
+}
+
+/* NAK就重试, 直到超时 */
+static int Token_Wait(int kind, int ep, uint8_t *data, int len, uint64_t deadline)
+{
+	for(;;)
+	{
+		int r = Token(kind, ep, data, len);
+		if(r != model::USB_NAK)
+			return r;
+		if(model::now_ns() > deadline)
+			return -ETIMEDOUT;
+		usleep(20);
+	}
+}
+
+int host::control(const uint8_t setup[8], uint8_t *data, int timeout_ms)
+{
+	uint64_t deadline = model::now_ns() + timeout_ms * 1000000ull;
+	int wlength = setup[6] | (setup[7] << 8);
+	bool in = setup[0] & 0x80;
+	int done = 0, r;
+	uint8_t buf[8];
+
+	for(int i = 0; i < 8; i++)
+		buf[i] = setup[i];
+	r = Token_Wait(0, 0, buf, 8, deadline);
+	if(r < 0)
+		return r == model::USB_STALL ? -EPIPE : r;
+	/* 数据阶段, EP0每包8字节 */
+	while(done < wlength)
+	{
+		int n = wlength - done > 8 ? 8 : wlength - done;
+		if(in)
+		{
+			r = Token_Wait(2, 0, data + done, n, deadline);
+			if(r < 0)
+				return r == model::USB_STALL ? -EPIPE : r;
+			done += r;
+			if(r < 8)
+				break;
+		}
+		else
+		{
+			r = Token_Wait(1, 0, data + done, n, deadline);
+			if(r < 0)
+				return r == model::USB_STALL ? -EPIPE : r;
+			done += n;
+		}
+	}
+	/* 状态阶段, 方向和数据阶段相反 */
+	if(in && wlength)
+		r = Token_Wait(1, 0, buf, 0, deadline);
+	else
+		r = Token_Wait(2, 0, buf, 8, deadline);
+	if(r < 0)
+		return r == model::USB_STALL ? -EPIPE : r;
+	return done;
+}
+
+int host::bulk_out(int ep, const uint8_t *data, int len)
+{
+	return Token(1, ep, (uint8_t *) data, len);
+}
+
+int host::bulk_in(int ep, uint8_t *buf, int max)
+{
+	return Token(2, ep, buf, max);
+}
+
+void host::bus_reset(void)
+{
+	std::lock_guard<std::mutex> g(Sie_Lock);
+
+	model::usb_bus_reset();
+}
+
+bool host::wait_attach(int timeout_ms)
+{
+	static const uint8_t Set_Address[8] = { 0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	uint64_t deadline = model::now_ns() + timeout_ms * 1000000ull;
+
+	while(model::attached() == false)
+	{
+		if(model::now_ns() > deadline)
+			return false;
+		usleep(1000);
+	}
+	bus_reset();
+	usleep(10000);
+	return control(Set_Address, nullptr, 1000) == 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * vft2232: USB host side of the rig, talks to the modelled SIE token by token.
+ */
+#ifndef VFT2232_HOST_H
+#define VFT2232_HOST_H
+
+#include <stdint.h>
+
+namespace host
+{
+
+/* a negative errno on failure: -EPIPE for STALL, -ETIMEDOUT */
+int control(const uint8_t setup[8], uint8_t *data, int timeout_ms);
+/* one packet, returns its length / 0 for OUT, or model::USB_NAK / model::USB_STALL */
+int bulk_out(int ep, const uint8_t *data, int len);
+int bulk_in(int ep, uint8_t *buf, int max);
+void bus_reset(void);
+/* wait for the pull-up, then reset the bus and set address 1 */
+bool wait_attach(int timeout_ms);
+
+int usbip_serve(int port);
+
+}
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ * CH552/CH554 SFR model for building the firmware on the host.
+ *
+ * Stands in for ch554_sdcc/include/ch554.h when src/main.c is compiled as
+ * C++ by the vft2232 test rig. Every SFR and sbit is an object whose reads
+ * and writes go through sfr_read()/sfr_write() in ch552.cpp, which is where
+ * the pins, timers, SPI, DataFlash and USB device controller are modelled.
+ * Addresses follow the datasheet; registers that share an address (ROM_CTRL
+ * and ROM_STATUS) or live in xdata (UEPn_DMA, UEPn_MOD) get slots above 0xff.
+ */
+#ifndef __CH554_H__
+#define __CH554_H__
+
+#include <stdint.h>
+
+/* SDCC storage classes and function attributes */
+#define __data
+#define __idata
+#define __pdata
+#define __xdata
+#define __code const
+#define __bit bool
+#define __interrupt(n)
+#define __using(n)
+#define __naked
+#define __reentrant
+#define __critical
+
+uint8_t sfr_read(uint16_t addr);		/* MOV A,sfr: port pins, live timer and status */
+uint8_t sfr_latch(uint16_t addr);		/* read-modify-write instructions see the port latch */
+void sfr_write(uint16_t addr, uint8_t val);
+void sfr_bit(uint16_t addr, uint8_t mask, uint8_t val);	/* SETB/CLR, atomic like on the chip */
+
+/* xdata lives in a 64 KiB aligned host mapping, so (uint16_t) of a pointer is its xdata address */
+#define XRAM_BASE	((uint8_t *) 0x100000000ULL)
+#define XRAM_SIZE_MODEL	0x10000
+extern uint8_t Code_Space[0x10000];
+
+class Sfr
+{
+public:
+	constexpr explicit Sfr(uint16_t a) : addr(a) {}
+	operator uint8_t() const { return sfr_read(addr); }
+	const Sfr &operator=(uint8_t v) const { sfr_write(addr, v); return *this; }
+	const Sfr &operator=(const Sfr &o) const { sfr_write(addr, (uint8_t) o); return *this; }
+	const Sfr &operator|=(uint8_t v) const { sfr_write(addr, sfr_latch(addr) | v); return *this; }
+	const Sfr &operator&=(uint8_t v) const { sfr_write(addr, sfr_latch(addr) & v); return *this; }
+	const Sfr &operator^=(uint8_t v) const { sfr_write(addr, sfr_latch(addr) ^ v); return *this; }
+	const Sfr &operator+=(uint8_t v) const { sfr_write(addr, sfr_latch(addr) + v); return *this; }
+	const Sfr &operator-=(uint8_t v) const { sfr_write(addr, sfr_latch(addr) - v); return *this; }
+	const Sfr &operator++() const { sfr_write(addr, sfr_latch(addr) + 1); return *this; }
+	const Sfr &operator--() const { sfr_write(addr, sfr_latch(addr) - 1); return *this; }
+	uint8_t operator++(int) const { uint8_t v = sfr_latch(addr); sfr_write(addr, v + 1); return v; }
+	uint8_t operator--(int) const { uint8_t v = sfr_latch(addr); sfr_write(addr, v - 1); return v; }
+	const uint16_t addr;
+};
+
+/* 16-bit xSFR pair, low byte at addr */
+class Sfr16
+{
+public:
+	constexpr explicit Sfr16(uint16_t a) : addr(a) {}
+	operator uint16_t() const { return sfr_read(addr) | (sfr_read(addr + 1) << 8); }
+	const Sfr16 &operator=(uint16_t v) const { sfr_write(addr, v & 0xff); sfr_write(addr + 1, v >> 8); return *this; }
+	const uint16_t addr;
+};
+
+class Sbit
+{
+public:
+	constexpr Sbit(uint16_t a, uint8_t b) : addr(a), mask(1 << b) {}
+	operator uint8_t() const { return (sfr_read(addr) & mask) ? 1 : 0; }
+	const Sbit &operator=(uint8_t v) const { sfr_bit(addr, mask, v); return *this; }
+	const Sbit &operator=(const Sbit &o) const { return *this = (uint8_t) o; }
+	const uint16_t addr;
+	const uint8_t mask;
+};
+
+#define SFR(name, a)		constexpr Sfr name{a}
+#define SFR16(name, a)		constexpr Sfr16 name{a}
+#define SBIT(name, a, b)	constexpr Sbit name{a, b}
+
+/* 系统 */
+SFR(PCON, 0x87);
+#define SMOD		0x80
+#define bRST_FLAG1	0x20
+#define bRST_FLAG0	0x10
+#define GF1			0x08
+#define GF0			0x04
+#define PD			0x02
+SFR(SAFE_MOD, 0xA1);
+SFR(GLOBAL_CFG, 0xB1);
+#define bBOOT_LOAD	0x20
+#define bSW_RESET	0x10
+#define bCODE_WE	0x08
+#define bDATA_WE	0x04
+#define bLDO3V3_OFF	0x02
+#define bWDOG_EN	0x01
+SFR(CLOCK_CFG, 0xB9);
+#define bOSC_EN_INT	0x80
+#define bOSC_EN_XT	0x40
+#define bWDOG_IF_TO	0x20
+#define bROM_CLK_FAST	0x10
+#define bRST		0x08
+#define MASK_SYS_CK_SEL	0x07
+SFR(WAKE_CTRL, 0xA9);
+SFR(RESET_KEEP, 0xFE);
+SFR(WDOG_COUNT, 0xFF);
+SFR(XBUS_AUX, 0xA2);
+#define bUART0_TX	0x80
+#define bUART0_RX	0x40
+#define bSAFE_MOD_ACT	0x20
+#define GF2			0x08
+#define bDPTR_AUTO_INC	0x04
+#define DPS			0x01
+
+/* 中断 */
+SFR(IE, 0xA8);
+SBIT(EA, 0xA8, 7);
+SBIT(E_DIS, 0xA8, 6);
+SBIT(ET2, 0xA8, 5);
+SBIT(ES, 0xA8, 4);
+SBIT(ET1, 0xA8, 3);
+SBIT(EX1, 0xA8, 2);
+SBIT(ET0, 0xA8, 1);
+SBIT(EX0, 0xA8, 0);
+SFR(IP, 0xB8);
+SBIT(PH_FLAG, 0xB8, 7);
+SBIT(PL_FLAG, 0xB8, 6);
+SBIT(PT2, 0xB8, 5);
+SBIT(PS, 0xB8, 4);
+SBIT(PT1, 0xB8, 3);
+SBIT(PX1, 0xB8, 2);
+SBIT(PT0, 0xB8, 1);
+SBIT(PX0, 0xB8, 0);
+SFR(IE_EX, 0xE8);
+SBIT(IE_WDOG, 0xE8, 7);
+SBIT(IE_GPIO, 0xE8, 6);
+SBIT(IE_PWMX, 0xE8, 5);
+SBIT(IE_UART1, 0xE8, 4);
+SBIT(IE_ADC, 0xE8, 3);
+SBIT(IE_USB, 0xE8, 2);
+SBIT(IE_TKEY, 0xE8, 1);
+SBIT(IE_SPI0, 0xE8, 0);
+SFR(IP_EX, 0xE9);
+#define bIP_LEVEL	0x80
+#define bIP_GPIO	0x40
+#define bIP_PWMX	0x20
+#define bIP_UART1	0x10
+#define bIP_ADC		0x08
+#define bIP_USB		0x04
+#define bIP_TKEY	0x02
+#define bIP_SPI0	0x01
+SFR(GPIO_IE, 0xC7);
+
+/* DataFlash */
+SFR(ROM_ADDR_L, 0x84);
+SFR(ROM_ADDR_H, 0x85);
+SFR(ROM_DATA_L, 0x8E);
+SFR(ROM_DATA_H, 0x8F);
+SFR(ROM_CTRL, 0x86);
+SFR(ROM_STATUS, 0x186);	/* 读ROM_CTRL地址 */
+#define bROM_ADDR_OK	0x40
+#define bROM_CMD_ERR	0x02
+#define ROM_CMD_WRITE	0x9A
+#define ROM_CMD_READ	0x8E
+#define DATA_FLASH_ADDR	0xC000
+
+/* 端口 */
+SFR(P1, 0x90);
+SBIT(SCK, 0x90, 7);
+SBIT(TXD1, 0x90, 7);
+SBIT(TIN5, 0x90, 7);
+SBIT(MISO, 0x90, 6);
+SBIT(RXD1, 0x90, 6);
+SBIT(TIN4, 0x90, 6);
+SBIT(MOSI, 0x90, 5);
+SBIT(PWM1, 0x90, 5);
+SBIT(TIN3, 0x90, 5);
+SBIT(UCC2, 0x90, 5);
+SBIT(AIN2, 0x90, 5);
+SBIT(T2_, 0x90, 4);
+SBIT(CAP1_, 0x90, 4);
+SBIT(SCS, 0x90, 4);
+SBIT(TIN2, 0x90, 4);
+SBIT(UCC1, 0x90, 4);
+SBIT(AIN1, 0x90, 4);
+SBIT(TXD_, 0x90, 3);
+SBIT(RXD_, 0x90, 2);
+SBIT(T2EX, 0x90, 1);
+SBIT(CAP2, 0x90, 1);
+SBIT(TIN1, 0x90, 1);
+SBIT(VBUS2, 0x90, 1);
+SBIT(AIN0, 0x90, 1);
+SBIT(T2, 0x90, 0);
+SBIT(CAP1, 0x90, 0);
+SBIT(TIN0, 0x90, 0);
+SFR(P1_MOD_OC, 0x92);
+SFR(P1_DIR_PU, 0x93);
+SFR(P2, 0xA0);
+SFR(P3, 0xB0);
+SBIT(UDM, 0xB0, 7);
+SBIT(UDP, 0xB0, 6);
+SBIT(T1, 0xB0, 5);
+SBIT(PWM2, 0xB0, 4);
+SBIT(RXD1_, 0xB0, 4);
+SBIT(T0, 0xB0, 4);
+SBIT(INT1, 0xB0, 3);
+SBIT(TXD1_, 0xB0, 2);
+SBIT(INT0, 0xB0, 2);
+SBIT(VBUS1, 0xB0, 2);
+SBIT(AIN3, 0xB0, 2);
+SBIT(PWM2_, 0xB0, 1);
+SBIT(TXD, 0xB0, 1);
+SBIT(PWM1_, 0xB0, 0);
+SBIT(RXD, 0xB0, 0);
+SFR(P3_MOD_OC, 0x96);
+SFR(P3_DIR_PU, 0x97);
+SFR(PIN_FUNC, 0xC6);
+#define bUSB_IO_EN	0x80
+#define bIO_INT_ACT	0x40
+#define bUART1_PIN_X	0x20
+#define bUART0_PIN_X	0x10
+#define bPWM2_PIN_X	0x08
+#define bPWM1_PIN_X	0x04
+#define bT2EX_PIN_X	0x02
+#define bT2_PIN_X	0x01
+
+/* 定时器0/1 */
+SFR(TCON, 0x88);
+SBIT(TF1, 0x88, 7);
+SBIT(TR1, 0x88, 6);
+SBIT(TF0, 0x88, 5);
+SBIT(TR0, 0x88, 4);
+SBIT(IE1, 0x88, 3);
+SBIT(IT1, 0x88, 2);
+SBIT(IE0, 0x88, 1);
+SBIT(IT0, 0x88, 0);
+SFR(TMOD, 0x89);
+#define bT1_GATE	0x80
+#define bT1_CT		0x40
+#define bT1_M1		0x20
+#define bT1_M0		0x10
+#define MASK_T1_MOD	0x30
+#define bT0_GATE	0x08
+#define bT0_CT		0x04
+#define bT0_M1		0x02
+#define bT0_M0		0x01
+#define MASK_T0_MOD	0x03
+SFR(TL0, 0x8A);
+SFR(TL1, 0x8B);
+SFR(TH0, 0x8C);
+SFR(TH1, 0x8D);
+
+/* 串口0 */
+SFR(SCON, 0x98);
+SBIT(SM0, 0x98, 7);
+SBIT(SM1, 0x98, 6);
+SBIT(SM2, 0x98, 5);
+SBIT(REN, 0x98, 4);
+SBIT(TB8, 0x98, 3);
+SBIT(RB8, 0x98, 2);
+SBIT(TI, 0x98, 1);
+SBIT(RI, 0x98, 0);
+SFR(SBUF, 0x99);
+
+/* 定时器2 */
+SFR(T2CON, 0xC8);
+SBIT(TF2, 0xC8, 7);
+SBIT(CAP1F, 0xC8, 7);
+SBIT(EXF2, 0xC8, 6);
+SBIT(RCLK, 0xC8, 5);
+SBIT(TCLK, 0xC8, 4);
+SBIT(EXEN2, 0xC8, 3);
+SBIT(TR2, 0xC8, 2);
+SBIT(C_T2, 0xC8, 1);
+SBIT(CP_RL2, 0xC8, 0);
+SFR(T2MOD, 0xC9);
+#define bTMR_CLK	0x80
+#define bT2_CLK		0x40
+#define bT1_CLK		0x20
+#define bT0_CLK		0x10
+#define bT2_CAP_M1	0x08
+#define bT2_CAP_M0	0x04
+#define T2OE		0x02
+#define bT2_CAP1_EN	0x01
+SFR(RCAP2L, 0xCA);
+SFR(RCAP2H, 0xCB);
+SFR(TL2, 0xCC);
+SFR(TH2, 0xCD);
+SFR(T2CAP1L, 0xCE);
+SFR(T2CAP1H, 0xCF);
+
+/* PWM */
+SFR(PWM_DATA2, 0x9B);
+SFR(PWM_DATA1, 0x9C);
+SFR(PWM_CTRL, 0x9D);
+SFR(PWM_CK_SE, 0x9E);
+
+/* SPI0 */
+SFR(SPI0_STAT, 0xF8);
+SBIT(S0_FST_ACT, 0xF8, 7);
+SBIT(S0_IF_OV, 0xF8, 6);
+SBIT(S0_IF_FIRST, 0xF8, 5);
+SBIT(S0_IF_BYTE, 0xF8, 4);
+SBIT(S0_FREE, 0xF8, 3);
+SBIT(S0_T_FIFO, 0xF8, 2);
+SBIT(S0_R_FIFO, 0xF8, 0);
+SFR(SPI0_DATA, 0xF9);
+SFR(SPI0_CTRL, 0xFA);
+#define bS0_MISO_OE	0x80
+#define bS0_MOSI_OE	0x40
+#define bS0_SCK_OE	0x20
+#define bS0_DATA_DIR	0x10
+#define bS0_MST_CLK	0x08
+#define bS0_2_WIRE	0x04
+#define bS0_CLR_ALL	0x02
+#define bS0_AUTO_IF	0x01
+SFR(SPI0_CK_SE, 0xFB);
+SFR(SPI0_S_PRE, 0xFB);
+SFR(SPI0_SETUP, 0xFC);
+#define bS0_MODE_SLV	0x80
+#define bS0_IE_FIFO_OV	0x40
+#define bS0_IE_FIRST	0x20
+#define bS0_IE_BYTE	0x10
+#define bS0_BIT_ORDER	0x08
+#define bS0_SLV_SELT	0x02
+#define bS0_SLV_PRELOAD	0x01
+
+/* 串口1 */
+SFR(SCON1, 0xC0);
+SBIT(U1SM0, 0xC0, 7);
+SBIT(U1SMOD, 0xC0, 5);
+SBIT(U1REN, 0xC0, 4);
+SBIT(U1TB8, 0xC0, 3);
+SBIT(U1RB8, 0xC0, 2);
+SBIT(U1TI, 0xC0, 1);
+SBIT(U1RI, 0xC0, 0);
+SFR(SBUF1, 0xC1);
+SFR(SBAUD1, 0xC2);
+
+/* USB */
+SFR(UDEV_CTRL, 0xD1);
+#define bUD_PD_DIS	0x80
+#define bUD_DP_PIN	0x20
+#define bUD_DM_PIN	0x10
+#define bUD_LOW_SPEED	0x04
+#define bUD_GP_BIT	0x02
+#define bUD_PORT_EN	0x01
+SFR(UEP1_CTRL, 0xD2);
+SFR(UEP1_T_LEN, 0xD3);
+SFR(UEP2_CTRL, 0xD4);
+SFR(UEP2_T_LEN, 0xD5);
+SFR(UEP3_CTRL, 0xD6);
+SFR(UEP3_T_LEN, 0xD7);
+SFR(USB_INT_FG, 0xD8);
+SBIT(U_IS_NAK, 0xD8, 7);
+SBIT(U_TOG_OK, 0xD8, 6);
+SBIT(U_SIE_FREE, 0xD8, 5);
+SBIT(UIF_FIFO_OV, 0xD8, 4);
+SBIT(UIF_HST_SOF, 0xD8, 3);
+SBIT(UIF_SUSPEND, 0xD8, 2);
+SBIT(UIF_TRANSFER, 0xD8, 1);
+SBIT(UIF_DETECT, 0xD8, 0);
+SBIT(UIF_BUS_RST, 0xD8, 0);
+SFR(USB_INT_ST, 0xD9);
+#define bUIS_IS_NAK	0x80
+#define bUIS_TOG_OK	0x40
+#define bUIS_TOKEN1	0x20
+#define bUIS_TOKEN0	0x10
+#define MASK_UIS_TOKEN	0x30
+#define UIS_TOKEN_OUT	0x00
+#define UIS_TOKEN_SOF	0x10
+#define UIS_TOKEN_IN	0x20
+#define UIS_TOKEN_SETUP	0x30
+#define MASK_UIS_ENDP	0x0F
+#define MASK_UIS_H_RES	0x0F
+SFR(USB_MIS_ST, 0xDA);
+#define bUMS_SOF_PRES	0x80
+#define bUMS_SOF_ACT	0x40
+#define bUMS_SIE_FREE	0x20
+#define bUMS_R_FIFO_RDY	0x10
+#define bUMS_BUS_RESET	0x08
+#define bUMS_SUSPEND	0x04
+#define bUMS_DM_LEVEL	0x02
+#define bUMS_DEV_ATTACH	0x01
+SFR(USB_RX_LEN, 0xDB);
+SFR(UEP0_CTRL, 0xDC);
+SFR(UEP0_T_LEN, 0xDD);
+SFR(UEP4_CTRL, 0xDE);
+SFR(UEP4_T_LEN, 0xDF);
+SFR(USB_INT_EN, 0xE1);
+#define bUIE_DEV_SOF	0x80
+#define bUIE_DEV_NAK	0x40
+#define bUIE_FIFO_OV	0x10
+#define bUIE_HST_SOF	0x08
+#define bUIE_SUSPEND	0x04
+#define bUIE_TRANSFER	0x02
+#define bUIE_DETECT	0x01
+#define bUIE_BUS_RST	0x01
+SFR(USB_CTRL, 0xE2);
+#define bUC_HOST_MODE	0x80
+#define bUC_LOW_SPEED	0x40
+#define bUC_DEV_PU_EN	0x20
+#define bUC_SYS_CTRL1	0x20
+#define bUC_SYS_CTRL0	0x10
+#define MASK_UC_SYS_CTRL	0x30
+#define bUC_INT_BUSY	0x08
+#define bUC_RESET_SIE	0x04
+#define bUC_CLR_ALL	0x02
+#define bUC_DMA_EN	0x01
+SFR(USB_DEV_AD, 0xE3);
+#define bUDA_GP_BIT	0x80
+#define MASK_USB_ADDR	0x7F
+/* UEPn_CTRL */
+#define bUEP_R_TOG	0x80
+#define bUEP_T_TOG	0x40
+#define bUEP_AUTO_TOG	0x10
+#define bUEP_R_RES1	0x08
+#define bUEP_R_RES0	0x04
+#define MASK_UEP_R_RES	0x0C
+#define UEP_R_RES_ACK	0x00
+#define UEP_R_RES_TOUT	0x04
+#define UEP_R_RES_NAK	0x08
+#define UEP_R_RES_STALL	0x0C
+#define bUEP_T_RES1	0x02
+#define bUEP_T_RES0	0x01
+#define MASK_UEP_T_RES	0x03
+#define UEP_T_RES_ACK	0x00
+#define UEP_T_RES_TOUT	0x01
+#define UEP_T_RES_NAK	0x02
+#define UEP_T_RES_STALL	0x03
+/* xdata里的USB寄存器 */
+SFR(UEP4_1_MOD, 0x1EA);
+#define bUEP1_RX_EN	0x80
+#define bUEP1_TX_EN	0x40
+#define bUEP1_BUF_MOD	0x10
+#define bUEP4_RX_EN	0x08
+#define bUEP4_TX_EN	0x04
+SFR(UEP2_3_MOD, 0x1EB);
+#define bUEP3_RX_EN	0x80
+#define bUEP3_TX_EN	0x40
+#define bUEP3_BUF_MOD	0x10
+#define bUEP2_RX_EN	0x08
+#define bUEP2_TX_EN	0x04
+#define bUEP2_BUF_MOD	0x01
+SFR16(UEP0_DMA, 0x1EC);
+SFR(UEP0_DMA_L, 0x1EC);
+SFR(UEP0_DMA_H, 0x1ED);
+SFR16(UEP1_DMA, 0x1EE);
+SFR(UEP1_DMA_L, 0x1EE);
+SFR(UEP1_DMA_H, 0x1EF);
+SFR16(UEP2_DMA, 0x1E4);
+SFR(UEP2_DMA_L, 0x1E4);
+SFR(UEP2_DMA_H, 0x1E5);
+SFR16(UEP3_DMA, 0x1E6);
+SFR(UEP3_DMA_L, 0x1E6);
+SFR(UEP3_DMA_H, 0x1E7);
+
+/* 中断号 */
+#define INT_NO_INT0	0
+#define INT_NO_TMR0	1
+#define INT_NO_INT1	2
+#define INT_NO_TMR1	3
+#define INT_NO_UART0	4
+#define INT_NO_TMR2	5
+#define INT_NO_SPI0	6
+#define INT_NO_TKEY	7
+#define INT_NO_USB	8
+#define INT_NO_ADC	9
+#define INT_NO_UART1	10
+#define INT_NO_PWMX	11
+#define INT_NO_GPIO	12
+#define INT_NO_WDOG	13
+
+#endif
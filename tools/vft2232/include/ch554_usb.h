@@ -0,0 +1,68 @@
+/*
+ * USB definitions used by the firmware, host build of the vft2232 test rig.
+ * Stands in for ch554_sdcc/include/ch554_usb.h.
+ */
+#ifndef __CH554_USB_H__
+#define __CH554_USB_H__
+
+#include <stdint.h>
+
+#define USB_GET_STATUS		0x00
+#define USB_CLEAR_FEATURE	0x01
+#define USB_SET_FEATURE		0x03
+#define USB_SET_ADDRESS		0x05
+#define USB_GET_DESCRIPTOR	0x06
+#define USB_SET_DESCRIPTOR	0x07
+#define USB_GET_CONFIGURATION	0x08
+#define USB_SET_CONFIGURATION	0x09
+#define USB_GET_INTERFACE	0x0A
+#define USB_SET_INTERFACE	0x0B
+#define USB_SYNCH_FRAME		0x0C
+
+#define USB_REQ_TYP_IN		0x80
+#define USB_REQ_TYP_OUT		0x00
+#define USB_REQ_TYP_READ	0x80
+#define USB_REQ_TYP_WRITE	0x00
+#define USB_REQ_TYP_MASK	0x60
+#define USB_REQ_TYP_STANDARD	0x00
+#define USB_REQ_TYP_CLASS	0x20
+#define USB_REQ_TYP_VENDOR	0x40
+#define USB_REQ_TYP_RESERVED	0x60
+#define USB_REQ_RECIP_MASK	0x1F
+#define USB_REQ_RECIP_DEVICE	0x00
+#define USB_REQ_RECIP_INTERF	0x01
+#define USB_REQ_RECIP_ENDP	0x02
+#define USB_REQ_RECIP_OTHER	0x03
+
+#define USB_DESCR_TYP_DEVICE	0x01
+#define USB_DESCR_TYP_CONFIG	0x02
+#define USB_DESCR_TYP_STRING	0x03
+#define USB_DESCR_TYP_INTERF	0x04
+#define USB_DESCR_TYP_ENDP	0x05
+#define USB_DESCR_TYP_QUALIF	0x06
+#define USB_DESCR_TYP_SPEED	0x07
+#define USB_DESCR_TYP_OTG	0x09
+
+
+#ifndef DEFAULT_ENDP0_SIZE
+#define DEFAULT_ENDP0_SIZE	8
+#endif
+#ifndef MAX_PACKET_SIZE
+#define MAX_PACKET_SIZE		64
+#endif
+
+typedef struct _USB_SETUP_REQ
+{
+	uint8_t bRequestType;
+	uint8_t bRequest;
+	uint8_t wValueL;
+	uint8_t wValueH;
+	uint8_t wIndexL;
+	uint8_t wIndexH;
+	uint8_t wLengthL;
+	uint8_t wLengthH;
+} USB_SETUP_REQ;
+
+typedef USB_SETUP_REQ *PUSB_SETUP_REQ;
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Clock and delay helpers, host build of the vft2232 test rig.
+ * Stands in for ch554_sdcc/include/debug.h; the delays wait on the host clock.
+ */
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include <stdint.h>
+
+#ifndef FREQ_SYS
+#define FREQ_SYS	12000000
+#endif
+
+#ifndef UART0_BAUD
+#define UART0_BAUD	9600
+#endif
+
+void CfgFsys(void);
+void mDelayuS(uint16_t n);
+void mDelaymS(uint16_t n);
+
+#endif
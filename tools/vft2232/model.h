@@ -0,0 +1,54 @@
+/*
+ * vft2232: CH552 model interface used by the host side of the rig.
+ *
+ * The firmware runs on the process main thread ("CPU thread"). Everything
+ * that happens to the chip from outside (USB tokens, timer ticks) is posted
+ * from other threads and applied on the CPU thread inside a SIGUSR1 handler,
+ * which is also where interrupt service routines run. That gives the
+ * firmware real preemption at any point, like on the 8051.
+ */
+#ifndef VFT2232_MODEL_H
+#define VFT2232_MODEL_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace model
+{
+
+/* USB token results */
+enum
+{
+	USB_ACK = 0,
+	USB_NAK = -1,
+	USB_STALL = -2,
+};
+
+struct Options
+{
+	std::vector<uint32_t> idcodes;		/* JTAG chain on interface A, in scan order (TDO side first) */
+	std::vector<uint32_t> idcodes_b;	/* chain on the interface B pins (MPSSE_CHAN_B builds) */
+	const char *flash_file = nullptr;	/* DataFlash image, loaded at start and written back on change */
+	int wait_io = 1;					/* level of the GPIOL1 (WAIT_IO, P3.3) input */
+	bool rtck = true;					/* target echoes TCK on RTCK (P3.2) */
+};
+
+/* call once on the CPU thread before anything else */
+void init(const Options &opt);
+/* run the firmware on the calling (CPU) thread, never returns */
+[[noreturn]] void run_cpu(void);
+/* called every 250 us from the clock thread */
+void tick(void);
+
+/* USB device side, callable from one non-CPU thread at a time */
+bool attached(void);
+void usb_bus_reset(void);
+int usb_setup(const uint8_t setup[8]);
+int usb_out(int ep, const uint8_t *data, int len);
+int usb_in(int ep, uint8_t *buf, int max);	/* returns the packet length, or USB_NAK/USB_STALL */
+
+uint64_t now_ns(void);
+
+}
+
+#endif
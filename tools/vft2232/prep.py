@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Turn src/main.c into a C++ translation unit for the vft2232 host model.
+
+The firmware is written for SDCC on the 8051.  Only the few constructs the
+header model cannot express are rewritten here, so the code under test stays
+the code that ships:
+
+  * __asm ... __endasm blocks are dropped and MPSSE_ASM_TMS is forced to 0,
+    so the C fallback of every assembly kernel is used.
+  * __xdata __at(addr) buffers become references into the XRAM mapping, so a
+    (uint16_t) pointer cast yields the real xdata address for UEPn_DMA.
+  * (__code uint8_t *) casts become offsets into the Code_Space image, which
+    holds the DataFlash and the chip ID bytes.
+  * Unsized arrays whose initializer uses their own sizeof (the descriptors)
+    get an explicit bound, which C++ needs.
+  * main() becomes fw_main(), started by the rig.
+  * NAME=VALUE arguments change a feature switch (#define NAME ...), the same
+    edit one would make in the source for a chip build.
+
+It also writes vectors.inc, the interrupt vector table.  __naked ISRs are
+pure assembly and are left out, so their sources (UART0) stay quiet.
+"""
+
+import re
+import sys
+
+
+def count_items(body):
+    """Number of top-level items in a brace initializer."""
+    body = re.sub(r"//[^\n]*|/\*.*?\*/", "", body, flags=re.S)
+    body = re.sub(r"'(\\.|[^'])'", "0", body)
+    depth = 0
+    items = [""]
+    for c in body:
+        if c == "(":
+            depth += 1
+        elif c == ")":
+            depth -= 1
+        if c == "," and depth == 0:
+            items.append("")
+        else:
+            items[-1] += c
+    return len([x for x in items if x.strip()])
+
+
+def main():
+    if len(sys.argv) < 4:
+        sys.exit("usage: prep.py main.c out.cpp vectors.inc [NAME=VALUE]...")
+    src, out, vec = sys.argv[1:4]
+    s = open(src, encoding="utf-8").read()
+
+    for arg in sys.argv[4:]:
+        name, value = arg.split("=", 1)
+        s, n = re.subn(r"^(#define[ \t]+%s[ \t]+)\S+" % re.escape(name), lambda m: m.group(1) + value, s, flags=re.M)
+        if n == 0:
+            sys.exit("prep.py: no #define %s in %s" % (name, src))
+
+    # keep the line count so compiler messages point at src/main.c
+    s = re.sub(r"__asm\b.*?__endasm\s*;", lambda m: ";" + "\n" * m.group(0).count("\n"), s, flags=re.S)
+    s = re.sub(r"(#define\s+MPSSE_ASM_TMS\s+)1\b", r"\g<1>0", s)
+    s = re.sub(r"__using\s+\d+", "", s)
+
+    def xram(m):
+        addr, typ, name, dims = m.group(1), m.group(2), m.group(3), m.group(4) or ""
+        if dims:
+            return "%s (&%s)%s = *reinterpret_cast<%s (*)%s>(XRAM_BASE + %s);" % (
+                typ, name, dims, typ, dims, addr)
+        return "%s &%s = *reinterpret_cast<%s *>(XRAM_BASE + %s);" % (typ, name, typ, addr)
+
+    s = re.sub(r"__xdata\s+__at\s*\(\s*(\w+)\s*\)\s+(\w+)\s+(\w+)\s*(\[[^\]]*\])?\s*;", xram, s)
+    s = re.sub(r"\(\s*__code\s+uint8_t\s*\*\s*\)", "Code_Space + ", s)
+
+    def sized(m):
+        name, body = m.group(2), m.group(4)
+        if "sizeof(%s)" % name not in body:
+            return m.group(0)
+        return "%s%s[%d]%s%s};" % (m.group(1), name, count_items(body), m.group(3), body)
+
+    s = re.sub(r"^([ \t]*\w[\w \t]*?\s)(\w+)\[\s*\](\s*=\s*(?://[^\n]*\s*)?\{)(.*?)\};", sized, s, flags=re.S | re.M)
+    s = re.sub(r"^main\s*\(\s*\)", "int fw_main(void)", s, flags=re.M)
+
+    vectors = {}
+    naked = set()
+    for m in re.finditer(r"void\s+(\w+)\s*\(\s*void\s*\)\s*__interrupt\s*\(\s*(\w+)\s*\)([^{;]*)", s):
+        name, num, attrs = m.groups()
+        vectors[num] = name
+        if "__naked" in attrs:
+            naked.add(num)
+    for num in naked:
+        del vectors[num]
+
+    with open(out, "w", encoding="utf-8") as f:
+        f.write('#line 1 "%s"\n' % src)
+        f.write(s)
+    with open(vec, "w", encoding="utf-8") as f:
+        for num, name in sorted(vectors.items()):
+            f.write("VECTOR(%s, %s)\n" % (num, name))
+
+
+if __name__ == "__main__":
+    main()
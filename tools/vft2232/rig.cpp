@@ -0,0 +1,218 @@
+/*
+ * vft2232: run src/main.c on the host against a modelled CH552 and JTAG chain.
+ *
+ *   vft2232 [options]              serve the device over USB/IP (usbip attach)
+ *   vft2232 --selftest [options]   enumerate, read IDCODEs over MPSSE, print throughput
+ *   add --chan-b to the self test for a firmware built with MPSSE_CHAN_B (make check-b)
+ *
+ * options:
+ *   --port N         USB/IP TCP port (3240)
+ *   --idcode X       add a device to the chain on interface A, repeatable, in scan order
+ *                    (next to TDO first); default one Gowin-like 0x0900281b
+ *   --idcode-b X     add a device to the chain on the interface B pins (MPSSE_CHAN_B builds)
+ *   --flash FILE     keep the DataFlash (0xA5 settings) in FILE
+ *   --wait-io N      level of GPIOL1 (P3.3) for 0x88/0x89/0x94/0x95
+ *   --no-rtck        leave RTCK unconnected (0x96 then waits out RTCK_TIMEOUT)
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "host.h"
+#include "model.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+static int Port = 3240;
+static bool Selftest;
+static bool Chan_B;
+static model::Options Opt;
+
+static void *Clock_Thread(void *)
+{
+	for(;;)
+	{
+		usleep(250);
+		model::tick();
+	}
+	return nullptr;
+}
+
+/*******************************************************************************
+* 自测
+*******************************************************************************/
+static int Failures;
+
+static void Check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if(ok == false)
+		Failures++;
+}
+
+static int Ctrl(uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+	uint8_t setup[8] = { type, req, (uint8_t) value, (uint8_t) (value >> 8), (uint8_t) index, (uint8_t) (index >> 8),
+		(uint8_t) len, (uint8_t) (len >> 8) };
+
+	return host::control(setup, data, 1000);
+}
+
+/* 发出MPSSE字节流, 同时收EP1, 去掉每包2字节的状态, 收够expect字节或超时 */
+static Bytes Mpsse(const Bytes &cmd, size_t expect, int ep_out = 2, int ep_in = 1)
+{
+	Bytes reply;
+	size_t sent = 0;
+	uint64_t deadline = model::now_ns() + 5000000000ull;
+	uint8_t buf[64];
+
+	while((sent < cmd.size() || reply.size() < expect) && model::now_ns() < deadline)
+	{
+		bool idle = true;
+		if(sent < cmd.size())
+		{
+			int n = cmd.size() - sent > 64 ? 64 : cmd.size() - sent;
+			if(host::bulk_out(ep_out, cmd.data() + sent, n) == model::USB_ACK)
+			{
+				sent += n;
+				idle = false;
+			}
+		}
+		int r = host::bulk_in(ep_in, buf, 64);
+		if(r > 2)
+		{
+			reply.insert(reply.end(), buf + 2, buf + r);
+			idle = false;
+		}
+		if(idle)
+			usleep(20);
+	}
+	return reply;
+}
+
+static uint32_t Le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int Run_Selftest(void)
+{
+	uint8_t desc[18];
+	Bytes r;
+
+	Check(host::wait_attach(2000), "device attaches and takes an address");
+	Check(Ctrl(0x80, 6, 0x0100, 0, desc, 18) == 18 && desc[8] == 0x03 && desc[9] == 0x04 && desc[10] == 0x10 && desc[11] == 0x60,
+		"device descriptor is FT2232 (0403:6010)");
+	Check(Ctrl(0x00, 9, 1, 0, nullptr, 0) == 0, "SET_CONFIGURATION");
+	Check(Ctrl(0x40, 0x00, 0, 1, nullptr, 0) == 0, "SIO reset on interface A");
+	Check(Ctrl(0x40, 0x0b, 0x0200, 1, nullptr, 0) == 0, "SET_BITMODE MPSSE");
+
+	uint32_t id = Opt.idcodes.empty() ? 0 : Opt.idcodes[0];
+	/* Test-Logic-Reset, Run-Test/Idle, Shift-DR, 硬件SPI整字节读32位 */
+	r = Mpsse({ 0x4b, 0x05, 0x1f, 0x4b, 0x03, 0x02, 0x39, 0x03, 0x00, 0, 0, 0, 0, 0x87 }, 4);
+	Check(r.size() == 4 && Le32(r.data()) == id, "IDCODE through the byte shifter (0x39)");
+	/* 同样走一遍按位移位 */
+	r = Mpsse({ 0x4b, 0x05, 0x1f, 0x4b, 0x03, 0x02, 0x3b, 0x07, 0, 0x3b, 0x07, 0, 0x3b, 0x07, 0, 0x3b, 0x07, 0, 0x87 }, 4);
+	Check(r.size() == 4 && Le32(r.data()) == id, "IDCODE through the bit shifter (0x3b)");
+	/* 厂商指令: 扫描链 */
+	r = Mpsse({ 0xc5, 0x87 }, 2 + 4 * Opt.idcodes.size());
+	bool chain = r.size() == 2 + 4 * Opt.idcodes.size() && r[0] == Opt.idcodes.size() && r[1] == 8 * Opt.idcodes.size();
+	for(size_t i = 0; chain && i < Opt.idcodes.size(); i++)
+		chain = Le32(&r[2 + 4 * i]) == Opt.idcodes[i];
+	Check(chain, "chain scan (0xc5) finds every device and the IR length");
+
+	/* 吞吐: Shift-DR里写64KiB */
+	Bytes bulk = { 0x4b, 0x05, 0x1f, 0x4b, 0x03, 0x02 };
+	for(int i = 0; i < 64; i++)
+	{
+		bulk.push_back(0x19);
+		bulk.push_back(0xff);
+		bulk.push_back(0x03);
+		bulk.insert(bulk.end(), 1024, 0x5a);
+	}
+	bulk.push_back(0x87);
+	uint64_t t = model::now_ns();
+	Mpsse(bulk, 0);
+	r = Mpsse({ 0x80, 0x00, 0x00, 0x81, 0x87 }, 1);
+	t = model::now_ns() - t;
+	Check(r.size() == 1, "64 KiB TDI write completes");
+	printf("info: 64 KiB through 0x19 in %.1f ms (model on this host, not the chip)\n", t / 1e6);
+
+	if(Chan_B)
+	{
+		uint32_t id_b = Opt.idcodes_b[0];
+		Check(Ctrl(0x40, 0x00, 0, 2, nullptr, 0) == 0, "SIO reset on interface B");
+		r = Mpsse({ 0x4b, 0x05, 0x1f, 0x4b, 0x03, 0x02, 0x39, 0x03, 0x00, 0, 0, 0, 0, 0x87 }, 4, 4, 3);
+		Check(r.size() == 4 && Le32(r.data()) == id_b, "IDCODE on interface B (0x39)");
+		r = Mpsse({ 0xc5, 0x87 }, 2, 4, 3);
+		Check(r.size() == 2 && r[0] == 0xfa && r[1] == 0xc5, "vendor opcodes answer 0xfa on interface B");
+		/* 接口A不受影响 */
+		r = Mpsse({ 0x4b, 0x05, 0x1f, 0x4b, 0x03, 0x02, 0x39, 0x03, 0x00, 0, 0, 0, 0, 0x87 }, 4);
+		Check(r.size() == 4 && Le32(r.data()) == id, "IDCODE on interface A after interface B");
+	}
+
+	printf("%s\n", Failures ? "selftest FAILED" : "selftest passed");
+	return Failures ? 1 : 0;
+}
+
+static void *Host_Thread(void *)
+{
+	exit(Selftest ? Run_Selftest() : host::usbip_serve(Port));
+	return nullptr;
+}
+
+static void Usage(void)
+{
+	fprintf(stderr, "usage: vft2232 [--selftest [--chan-b]] [--port N] [--idcode X]... [--idcode-b X]... [--flash FILE] [--wait-io 0|1] [--no-rtck]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		const char *a = argv[i];
+		const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+		if(strcmp(a, "--selftest") == 0)
+			Selftest = true;
+		else if(strcmp(a, "--chan-b") == 0)
+			Chan_B = true;
+		else if(strcmp(a, "--no-rtck") == 0)
+			Opt.rtck = false;
+		else if(v == nullptr)
+			Usage();
+		else if(strcmp(a, "--port") == 0)
+			Port = atoi(v), i++;
+		else if(strcmp(a, "--idcode") == 0)
+			Opt.idcodes.push_back(strtoul(v, nullptr, 0)), i++;
+		else if(strcmp(a, "--idcode-b") == 0)
+			Opt.idcodes_b.push_back(strtoul(v, nullptr, 0)), i++;
+		else if(strcmp(a, "--flash") == 0)
+			Opt.flash_file = v, i++;
+		else if(strcmp(a, "--wait-io") == 0)
+			Opt.wait_io = atoi(v), i++;
+		else
+			Usage();
+	}
+	if(Opt.idcodes.empty())
+		Opt.idcodes.push_back(0x0900281b);
+	if(Opt.idcodes_b.empty())
+		Opt.idcodes_b.push_back(0x0900281b);
+
+	/* 只有CPU线程接SIGUSR1 */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+	model::init(Opt);
+
+	pthread_t t;
+	pthread_create(&t, nullptr, Clock_Thread, nullptr);
+	pthread_create(&t, nullptr, Host_Thread, nullptr);
+	model::run_cpu();
+}
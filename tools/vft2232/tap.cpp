@@ -0,0 +1,126 @@
+/*
+ * vft2232: IEEE 1149.1 TAP chain behind the JTAG pins.
+ */
+#include "tap.h"
+
+enum
+{
+	TLR, RTI, SEL_DR, CAP_DR, SH_DR, EX1_DR, PAUSE_DR, EX2_DR, UPD_DR,
+	SEL_IR, CAP_IR, SH_IR, EX1_IR, PAUSE_IR, EX2_IR, UPD_IR,
+};
+
+/* next state for TMS = 0 / 1 */
+static const uint8_t Tap_Next[16][2] = {
+	[TLR] = { RTI, TLR },
+	[RTI] = { RTI, SEL_DR },
+	[SEL_DR] = { CAP_DR, SEL_IR },
+	[CAP_DR] = { SH_DR, EX1_DR },
+	[SH_DR] = { SH_DR, EX1_DR },
+	[EX1_DR] = { PAUSE_DR, UPD_DR },
+	[PAUSE_DR] = { PAUSE_DR, EX2_DR },
+	[EX2_DR] = { SH_DR, UPD_DR },
+	[UPD_DR] = { RTI, SEL_DR },
+	[SEL_IR] = { CAP_IR, TLR },
+	[CAP_IR] = { SH_IR, EX1_IR },
+	[SH_IR] = { SH_IR, EX1_IR },
+	[EX1_IR] = { PAUSE_IR, UPD_IR },
+	[PAUSE_IR] = { PAUSE_IR, EX2_IR },
+	[EX2_IR] = { SH_IR, UPD_IR },
+	[UPD_IR] = { RTI, SEL_DR },
+};
+
+void Tap_Chain::Set_Devices(const std::vector<uint32_t> &idcodes)
+{
+	devs.clear();
+	for(auto it = idcodes.rbegin(); it != idcodes.rend(); ++it)
+	{
+		Device d = {};
+		d.idcode = *it;
+		d.state = TLR;
+		d.ir = IR_IDCODE;
+		d.tdo = 1;
+		devs.push_back(d);
+	}
+	tdo = 1;
+}
+
+/* 上升沿: 在当前状态采样/移位, 然后按TMS转移 */
+void Tap_Chain::Device::Rise(int tms, int tdi)
+{
+	switch(state)
+	{
+	case TLR:
+		ir = IR_IDCODE;
+		break;
+	case CAP_DR:
+		if(ir == IR_IDCODE)
+		{
+			dr = idcode;
+			dr_len = 32;
+		}
+		else if(ir == IR_USERCODE)
+		{
+			dr = 0;
+			dr_len = 32;
+		}
+		else
+		{
+			dr = 0;
+			dr_len = 1;
+		}
+		break;
+	case SH_DR:
+		dr = (dr >> 1) | ((uint32_t) tdi << (dr_len - 1));
+		break;
+	case CAP_IR:
+		ir_shift = 0x01;
+		break;
+	case SH_IR:
+		ir_shift = (ir_shift >> 1) | (tdi << (IR_LEN - 1));
+		break;
+	case UPD_IR:
+		ir = ir_shift;
+		break;
+	}
+	state = Tap_Next[state][tms];
+}
+
+/* 下降沿: TDO在移位状态输出最低位, 其它时候高阻(上拉读到1) */
+void Tap_Chain::Device::Fall(void)
+{
+	if(state == SH_DR)
+		tdo = dr & 1;
+	else if(state == SH_IR)
+		tdo = ir_shift & 1;
+	else
+		tdo = 1;
+}
+
+void Tap_Chain::Clock(int level, int tms, int tdi)
+{
+	level = level ? 1 : 0;
+	tms = tms ? 1 : 0;
+	tdi = tdi ? 1 : 0;
+	if(level == tck)
+		return;
+	tck = level;
+	if(devs.empty())
+		return;
+	if(tck)
+	{
+		/* 每个器件的TDI是前一个器件在这个沿之前的TDO */
+		int in = tdi;
+		for(Device &d : devs)
+		{
+			int out = d.tdo;
+			d.Rise(tms, in);
+			in = out;
+		}
+	}
+	else
+	{
+		for(Device &d : devs)
+			d.Fall();
+		tdo = devs.back().tdo;
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * vft2232: IEEE 1149.1 TAP chain behind the JTAG pins.
+ *
+ * Each device has an 8-bit IR that resets to IDCODE (0x11, as on the Gowin
+ * parts), USERCODE is 0x13 and every other instruction selects BYPASS.
+ */
+#ifndef VFT2232_TAP_H
+#define VFT2232_TAP_H
+
+#include <stdint.h>
+#include <vector>
+
+class Tap_Chain
+{
+public:
+	enum
+	{
+		IR_LEN = 8,
+		IR_IDCODE = 0x11,
+		IR_USERCODE = 0x13,
+	};
+
+	/* in scan order: the device next to TDO comes first, like a DR read after reset */
+	void Set_Devices(const std::vector<uint32_t> &idcodes);
+	/* level of TDO at the end of the chain */
+	int Tdo(void) const { return tdo; }
+	/* drive TCK with the TMS/TDI levels present on the pins */
+	void Clock(int tck, int tms, int tdi);
+
+private:
+	struct Device
+	{
+		uint32_t idcode;
+		int state;
+		uint8_t ir;
+		uint8_t ir_shift;
+		uint32_t dr;
+		int dr_len;
+		int tdo;
+
+		void Rise(int tms, int tdi);
+		void Fall(void);
+	};
+
+	std::vector<Device> devs;	/* TDI side first */
+	int tck = 0;
+	int tdo = 1;
+};
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * vft2232: USB/IP server for the modelled device, protocol version 1.1.1.
+ *
+ * One client at a time, one exported device at bus id 1-1. URBs queue per
+ * endpoint; the scheduler keeps offering tokens to the head URB of every
+ * endpoint, so a NAKing bulk IN never holds up the bulk OUT behind it.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "host.h"
+#include "model.h"
+
+#define USBIP_VERSION		0x0111
+#define OP_REQ_DEVLIST		0x8005
+#define OP_REP_DEVLIST		0x0005
+#define OP_REQ_IMPORT		0x8003
+#define OP_REP_IMPORT		0x0003
+#define USBIP_CMD_SUBMIT	1
+#define USBIP_CMD_UNLINK	2
+#define USBIP_RET_SUBMIT	3
+#define USBIP_RET_UNLINK	4
+#define URB_ZERO_PACKET		0x0040
+#define BUS_ID				"1-1"
+
+struct Urb
+{
+	uint32_t seqnum;
+	uint32_t dir;		/* 0 OUT, 1 IN */
+	uint32_t ep;
+	uint32_t flags;
+	uint8_t setup[8];
+	std::vector<uint8_t> data;
+	size_t done = 0;
+	bool zlp_sent = false;
+};
+
+static std::mutex Lock;
+static std::condition_variable Wake;
+static std::list<Urb> Pending;
+static std::mutex Tx_Lock;
+static int Client = -1;
+static uint8_t Dev_Desc[18];
+static std::vector<uint8_t> Cfg_Desc;
+
+static bool Recv_All(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *) buf;
+
+	while(len)
+	{
+		ssize_t r = recv(fd, p, len, 0);
+		if(r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool Send_All(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+
+	while(len)
+	{
+		ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+		if(r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static void Put16(std::vector<uint8_t> &v, uint16_t x)
+{
+	v.push_back(x >> 8);
+	v.push_back(x);
+}
+
+static void Put32(std::vector<uint8_t> &v, uint32_t x)
+{
+	Put16(v, x >> 16);
+	Put16(v, x);
+}
+
+static uint32_t Get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*******************************************************************************
+* 描述符, 设备列表
+*******************************************************************************/
+static bool Fetch_Descriptors(void)
+{
+	uint8_t setup[8] = { 0x80, 6, 0, 1, 0, 0, 18, 0 };
+	uint8_t head[9];
+
+	if(host::control(setup, Dev_Desc, 1000) != 18)
+		return false;
+	setup[3] = 2;
+	setup[6] = 9;
+	if(host::control(setup, head, 1000) != 9)
+		return false;
+	Cfg_Desc.resize(head[2] | (head[3] << 8));
+	setup[6] = Cfg_Desc.size();
+	setup[7] = Cfg_Desc.size() >> 8;
+	return host::control(setup, Cfg_Desc.data(), 1000) == (int) Cfg_Desc.size();
+}
+
+static void Put_Device(std::vector<uint8_t> &v, bool interfaces)
+{
+	char path[256] = "/sys/devices/vft2232/" BUS_ID;
+	char busid[32] = BUS_ID;
+
+	v.insert(v.end(), path, path + sizeof(path));
+	v.insert(v.end(), busid, busid + sizeof(busid));
+	Put32(v, 1);	/* busnum */
+	Put32(v, 1);	/* devnum */
+	Put32(v, 2);	/* USB_SPEED_FULL */
+	Put16(v, Dev_Desc[8] | (Dev_Desc[9] << 8));
+	Put16(v, Dev_Desc[10] | (Dev_Desc[11] << 8));
+	Put16(v, Dev_Desc[12] | (Dev_Desc[13] << 8));
+	v.push_back(Dev_Desc[4]);
+	v.push_back(Dev_Desc[5]);
+	v.push_back(Dev_Desc[6]);
+	v.push_back(Cfg_Desc[5]);
+	v.push_back(Dev_Desc[17]);
+	v.push_back(Cfg_Desc[4]);
+	if(interfaces == false)
+		return;
+	for(size_t i = 0; i + 1 < Cfg_Desc.size() && Cfg_Desc[i]; i += Cfg_Desc[i])
+	{
+		if(Cfg_Desc[i + 1] != 4)
+			continue;
+		v.push_back(Cfg_Desc[i + 5]);
+		v.push_back(Cfg_Desc[i + 6]);
+		v.push_back(Cfg_Desc[i + 7]);
+		v.push_back(0);
+	}
+}
+
+/*******************************************************************************
+* URB
+*******************************************************************************/
+static void Complete(const Urb &u, int status)
+{
+	std::vector<uint8_t> v;
+	size_t len = u.dir ? u.done : (status == 0 ? u.data.size() : u.done);
+
+	Put32(v, USBIP_RET_SUBMIT);
+	Put32(v, u.seqnum);
+	Put32(v, 0);
+	Put32(v, 0);
+	Put32(v, 0);
+	Put32(v, status);
+	Put32(v, len);
+	Put32(v, 0);	/* start_frame */
+	Put32(v, 0);	/* number_of_packets */
+	Put32(v, 0);	/* error_count */
+	v.insert(v.end(), 8, 0);
+	if(u.dir)
+		v.insert(v.end(), u.data.begin(), u.data.begin() + u.done);
+	std::lock_guard<std::mutex> g(Tx_Lock);
+	Send_All(Client, v.data(), v.size());
+}
+
+/* 给一个URB一个令牌, 返回: 0 NAK, 1 有进展, 2 完成 */
+static int Step(Urb &u, int &status)
+{
+	int r;
+
+	status = 0;
+	if(u.ep == 0)
+	{
+		r = host::control(u.setup, u.data.data(), 1000);
+		if(r < 0)
+			status = r;
+		else
+			u.done = r;
+		return 2;
+	}
+	if(u.dir)
+	{
+		size_t max = u.data.size() - u.done;
+		if(max == 0)
+			return 2;
+		r = host::bulk_in(u.ep, u.data.data() + u.done, max > 64 ? 64 : max);
+		if(r == model::USB_NAK)
+			return 0;
+		if(r == model::USB_STALL)
+		{
+			status = -EPIPE;
+			return 2;
+		}
+		u.done += r;
+		return (r < 64 || u.done == u.data.size()) ? 2 : 1;
+	}
+	size_t n = u.data.size() - u.done;
+	if(n == 0 && (u.zlp_sent || (u.data.size() && !((u.flags & URB_ZERO_PACKET) && u.data.size() % 64 == 0))))
+		return 2;
+	if(n > 64)
+		n = 64;
+	r = host::bulk_out(u.ep, u.data.data() + u.done, n);
+	if(r == model::USB_NAK)
+		return 0;
+	if(r == model::USB_STALL)
+	{
+		status = -EPIPE;
+		return 2;
+	}
+	u.done += n;
+	if(n == 0)
+		u.zlp_sent = true;
+	return 1;
+}
+
+static void Scheduler(void)
+{
+	for(;;)
+	{
+		bool progress = false;
+		uint32_t seen = 0;
+		std::unique_lock<std::mutex> g(Lock);
+		if(Pending.empty())
+			Wake.wait(g);
+		for(auto it = Pending.begin(); it != Pending.end();)
+		{
+			uint32_t key = 1u << ((it->ep & 15) + (it->dir ? 16 : 0));
+			if(seen & key)
+			{
+				++it;
+				continue;
+			}
+			seen |= key;
+			/* 令牌期间放开队列, 读线程能继续收URB和UNLINK */
+			Urb u = std::move(*it);
+			it = Pending.erase(it);
+			g.unlock();
+			int status, r = Step(u, status);
+			g.lock();
+			if(r == 2)
+				Complete(u, status);
+			else
+				it = Pending.insert(it, std::move(u)), ++it;
+			if(r)
+				progress = true;
+		}
+		if(progress == false)
+		{
+			g.unlock();
+			usleep(50);
+		}
+	}
+}
+
+static void Handle_Client(int fd)
+{
+	uint8_t hdr[48];
+
+	while(Recv_All(fd, hdr, sizeof(hdr)))
+	{
+		uint32_t cmd = Get32(hdr);
+		if(cmd == USBIP_CMD_SUBMIT)
+		{
+			Urb u;
+			u.seqnum = Get32(hdr + 4);
+			u.dir = Get32(hdr + 12);
+			u.ep = Get32(hdr + 16);
+			u.flags = Get32(hdr + 20);
+			u.data.resize(Get32(hdr + 24));
+			memcpy(u.setup, hdr + 40, 8);
+			if(u.dir == 0 && u.data.size() && Recv_All(fd, u.data.data(), u.data.size()) == false)
+				break;
+			std::lock_guard<std::mutex> g(Lock);
+			Pending.push_back(std::move(u));
+			Wake.notify_one();
+		}
+		else if(cmd == USBIP_CMD_UNLINK)
+		{
+			uint32_t victim = Get32(hdr + 20);
+			int status = 0;
+			{
+				std::lock_guard<std::mutex> g(Lock);
+				for(auto it = Pending.begin(); it != Pending.end(); ++it)
+					if(it->seqnum == victim)
+					{
+						Pending.erase(it);
+						status = -ECONNRESET;
+						break;
+					}
+			}
+			std::vector<uint8_t> v;
+			Put32(v, USBIP_RET_UNLINK);
+			Put32(v, Get32(hdr + 4));
+			Put32(v, 0);
+			Put32(v, 0);
+			Put32(v, 0);
+			Put32(v, status);
+			v.insert(v.end(), 24, 0);
+			std::lock_guard<std::mutex> g(Tx_Lock);
+			Send_All(fd, v.data(), v.size());
+		}
+		else
+			break;
+	}
+}
+
+int host::usbip_serve(int port)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+	struct sockaddr_in a = {};
+
+	if(wait_attach(2000) == false || Fetch_Descriptors() == false)
+	{
+		fprintf(stderr, "vft2232: device did not enumerate\n");
+		return 1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(s, (struct sockaddr *) &a, sizeof(a)) < 0 || listen(s, 1) < 0)
+	{
+		perror("vft2232: usbip socket");
+		return 1;
+	}
+	fprintf(stderr, "vft2232: %04x:%04x on usbip port %d, bus id " BUS_ID "\n",
+		Dev_Desc[8] | (Dev_Desc[9] << 8), Dev_Desc[10] | (Dev_Desc[11] << 8), port);
+	std::thread(Scheduler).detach();
+
+	for(;;)
+	{
+		int fd = accept(s, nullptr, nullptr);
+		uint8_t op[8];
+		if(fd < 0)
+			continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(Recv_All(fd, op, sizeof(op)) == false)
+		{
+			close(fd);
+			continue;
+		}
+		std::vector<uint8_t> v;
+		uint16_t code = (op[2] << 8) | op[3];
+		if(code == OP_REQ_DEVLIST)
+		{
+			Put16(v, USBIP_VERSION);
+			Put16(v, OP_REP_DEVLIST);
+			Put32(v, 0);
+			Put32(v, 1);
+			Put_Device(v, true);
+			Send_All(fd, v.data(), v.size());
+		}
+		else if(code == OP_REQ_IMPORT)
+		{
+			char busid[32];
+			bool ok = Recv_All(fd, busid, sizeof(busid)) && strncmp(busid, BUS_ID, sizeof(busid)) == 0;
+			Put16(v, USBIP_VERSION);
+			Put16(v, OP_REP_IMPORT);
+			Put32(v, ok ? 0 : 1);
+			if(ok)
+			{
+				/* 重新枚举, 像插上一样 */
+				host::bus_reset();
+				Put_Device(v, false);
+			}
+			Send_All(fd, v.data(), v.size());
+			if(ok)
+			{
+				Client = fd;
+				Handle_Client(fd);
+				std::lock_guard<std::mutex> g(Lock);
+				Pending.clear();
+				Client = -1;
+			}
+		}
+		close(fd);
+	}
+}